@@ -0,0 +1,515 @@
+// CANでアプリケーションを書き換えるブートローダ。HALは使わずレジスタを直接触る
+// フラッシュの配置と通信の取り決めはCore/Inc/boot_layout.hppを参照
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <optional>
+
+#include "stm32f1xx.h"
+
+#include <CRSLibtmp/std_type.hpp>
+#include "boot_layout.hpp"
+
+using namespace CRSLib::IntegerTypes;
+using namespace Nhk23Servo::Boot;
+
+extern "C"
+{
+	extern u32 _estack;
+	extern u32 _sidata;
+	extern u32 _sdata;
+	extern u32 _edata;
+	extern u32 _sbss;
+	extern u32 _ebss;
+
+	[[noreturn]] void Reset_Handler() noexcept;
+	[[noreturn]] void Default_Handler() noexcept;
+}
+
+namespace
+{
+	// 割り込みは使わないので、例外のベクタだけ置く
+	[[gnu::section(".isr_vector"), gnu::used]] const std::array<const void *, 16> vectors
+	{
+		&_estack,
+		reinterpret_cast<const void *>(&Reset_Handler),
+		reinterpret_cast<const void *>(&Default_Handler),  // NMI
+		reinterpret_cast<const void *>(&Default_Handler),  // HardFault
+		reinterpret_cast<const void *>(&Default_Handler),  // MemManage
+		reinterpret_cast<const void *>(&Default_Handler),  // BusFault
+		reinterpret_cast<const void *>(&Default_Handler)  // UsageFault
+	};
+
+	struct Received final
+	{
+		u32 id;
+		u8 dlc;
+		std::array<u8, 8> data;
+	};
+
+	void clock_init() noexcept
+	{
+		// HSE 8MHz * 9 = 72MHz。アプリケーションと同じ
+		RCC->CR = RCC->CR | RCC_CR_HSEON;
+		while(!(RCC->CR & RCC_CR_HSERDY));
+
+		FLASH->ACR = FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY_2;
+		RCC->CFGR = RCC_CFGR_PLLMULL9 | RCC_CFGR_PLLSRC | RCC_CFGR_PPRE1_DIV2;
+		RCC->CR = RCC->CR | RCC_CR_PLLON;
+		while(!(RCC->CR & RCC_CR_PLLRDY));
+
+		RCC->CFGR = RCC->CFGR | RCC_CFGR_SW_PLL;
+		while((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL);
+	}
+
+	/// @brief アプリケーションのSystemClock_ConfigがリセットのときとおなじようにPLLを設定できるよう、HSIに戻す
+	void clock_deinit() noexcept
+	{
+		RCC->CFGR = RCC->CFGR & ~RCC_CFGR_SW;
+		while((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSI);
+		RCC->CR = RCC->CR & ~(RCC_CR_PLLON | RCC_CR_HSEON);
+		RCC->CFGR = 0;
+		FLASH->ACR = FLASH_ACR_PRFTBE;
+	}
+
+	void backup_enable() noexcept
+	{
+		RCC->APB1ENR = RCC->APB1ENR | RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+		PWR->CR = PWR->CR | PWR_CR_DBP;
+	}
+
+	volatile u32& backup_register(const u8 index) noexcept
+	{
+		// DR1~DR10は0x04から4byteおき
+		return *reinterpret_cast<volatile u32 *>(BKP_BASE + 4 * index);
+	}
+
+	u8 node_id() noexcept
+	{
+		// オプションバイトのData0。下位8bitが値
+		const u8 data0 = *reinterpret_cast<const volatile u8 *>(0x1FFF'F804);
+		return data0 > node_max ? 0 : data0;
+	}
+
+	void can_init(const u8 node) noexcept
+	{
+		RCC->APB2ENR = RCC->APB2ENR | RCC_APB2ENR_IOPBEN | RCC_APB2ENR_AFIOEN;
+		RCC->APB1ENR = RCC->APB1ENR | RCC_APB1ENR_CAN1EN;
+
+		// PB8: CAN_RX(浮動入力), PB9: CAN_TX(AFプッシュプル50MHz)。アプリケーションと同じく再配置2
+		AFIO->MAPR = (AFIO->MAPR & ~AFIO_MAPR_CAN_REMAP) | AFIO_MAPR_CAN_REMAP_REMAP2;
+		GPIOB->CRH = (GPIOB->CRH & ~0xFFu) | 0x4u | 0xBu << 4;
+
+		CAN1->MCR = CAN_MCR_INRQ;
+		while(!(CAN1->MSR & CAN_MSR_INAK));
+
+		// アプリケーションと同じビットタイミング(boot_layout.hpp)。BTRの各欄は値-1
+		CAN1->BTR = (can_sjw_tq - 1) << CAN_BTR_SJW_Pos | (can_bs2_tq - 1) << CAN_BTR_TS2_Pos | (can_bs1_tq - 1) << CAN_BTR_TS1_Pos | (can_prescaler - 1) << CAN_BTR_BRP_Pos;
+
+		// フィルタ0: 自分宛てのコマンドだけをFIFO0へ(32bitリスト)
+		const u32 id = (command_id_base + node) << CAN_RI0R_STID_Pos;
+		CAN1->FMR = CAN1->FMR | CAN_FMR_FINIT;
+		CAN1->FA1R = 0;
+		CAN1->FM1R = 1;
+		CAN1->FS1R = 1;
+		CAN1->FFA1R = 0;
+		CAN1->sFilterRegister[0].FR1 = id;
+		CAN1->sFilterRegister[0].FR2 = id;
+		CAN1->FA1R = 1;
+		CAN1->FMR = CAN1->FMR & ~CAN_FMR_FINIT;
+
+		CAN1->MCR = CAN_MCR_ABOM;
+		while(CAN1->MSR & CAN_MSR_INAK);
+	}
+
+	void can_deinit() noexcept
+	{
+		RCC->APB1RSTR = RCC->APB1RSTR | RCC_APB1RSTR_CAN1RST;
+		RCC->APB1RSTR = RCC->APB1RSTR & ~RCC_APB1RSTR_CAN1RST;
+		RCC->APB1ENR = RCC->APB1ENR & ~RCC_APB1ENR_CAN1EN;
+	}
+
+	std::optional<Received> can_receive() noexcept
+	{
+		if(!(CAN1->RF0R & CAN_RF0R_FMP0)) return std::nullopt;
+
+		const auto& mailbox = CAN1->sFIFOMailBox[0];
+		Received ret{};
+		ret.id = mailbox.RIR >> CAN_RI0R_STID_Pos;
+		ret.dlc = mailbox.RDTR & CAN_RDT0R_DLC;
+		const u32 low = mailbox.RDLR;
+		const u32 high = mailbox.RDHR;
+		for(u8 i = 0; i < 4; ++i)
+		{
+			ret.data[i] = low >> (8 * i);
+			ret.data[4 + i] = high >> (8 * i);
+		}
+		CAN1->RF0R = CAN_RF0R_RFOM0;
+		return ret;
+	}
+
+	void can_post(const u32 id, const std::array<u8, 8>& data, const u8 dlc) noexcept
+	{
+		// 返事は少ないので、空くまで待つ
+		while(!(CAN1->TSR & CAN_TSR_TME0));
+
+		auto& mailbox = CAN1->sTxMailBox[0];
+		mailbox.TDTR = dlc;
+		mailbox.TDLR = data[0] | data[1] << 8 | data[2] << 16 | (u32)data[3] << 24;
+		mailbox.TDHR = data[4] | data[5] << 8 | data[6] << 16 | (u32)data[7] << 24;
+		mailbox.TIR = id << CAN_TI0R_STID_Pos | CAN_TI0R_TXRQ;
+	}
+
+	void flash_wait() noexcept
+	{
+		while(FLASH->SR & FLASH_SR_BSY);
+	}
+
+	void flash_unlock() noexcept
+	{
+		if(FLASH->CR & FLASH_CR_LOCK)
+		{
+			FLASH->KEYR = 0x4567'0123;
+			FLASH->KEYR = 0xCDEF'89AB;
+		}
+	}
+
+	void flash_lock() noexcept
+	{
+		FLASH->CR = FLASH->CR | FLASH_CR_LOCK;
+	}
+
+	bool flash_erase_page(const u32 address) noexcept
+	{
+		flash_wait();
+		FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+		FLASH->CR = FLASH->CR | FLASH_CR_PER;
+		FLASH->AR = address;
+		FLASH->CR = FLASH->CR | FLASH_CR_STRT;
+		flash_wait();
+		FLASH->CR = FLASH->CR & ~FLASH_CR_PER;
+		return !(FLASH->SR & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR));
+	}
+
+	bool flash_program(const u32 address, const u16 value) noexcept
+	{
+		flash_wait();
+		FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+		FLASH->CR = FLASH->CR | FLASH_CR_PG;
+		*reinterpret_cast<volatile u16 *>(address) = value;
+		flash_wait();
+		FLASH->CR = FLASH->CR & ~FLASH_CR_PG;
+		return *reinterpret_cast<const volatile u16 *>(address) == value;
+	}
+
+	const Trailer& get_trailer(const u8 slot) noexcept
+	{
+		return *reinterpret_cast<const Trailer *>(trailer_address(slots[slot]));
+	}
+
+	u32 calc_crc(const u8 slot, const u32 size) noexcept
+	{
+		Crc32 crc{};
+		const auto * const image = reinterpret_cast<const u8 *>(slots[slot].address);
+		for(u32 i = 0; i < size; ++i) crc.update(image[i]);
+		return crc.get();
+	}
+
+	/// @brief Trailerがあり、却下されておらず、ベクタテーブルがそれらしい
+	bool is_bootable(const u8 slot) noexcept
+	{
+		const auto& trailer = get_trailer(slot);
+		if(trailer.magic != trailer_magic || trailer.rejected == flag_set) return false;
+		if(trailer.size > image_capacity(slots[slot])) return false;
+
+		const auto * const vector = reinterpret_cast<const u32 *>(slots[slot].address);
+		const bool stack_in_ram = (vector[0] & 0xFFFE'0000) == SRAM_BASE;
+		const bool reset_in_slot = slots[slot].address <= vector[1] && vector[1] < slots[slot].address + trailer.size;
+		return stack_in_ram && reset_in_slot;
+	}
+
+	/// @brief 起動できるスロットのうち最も新しいもの
+	/// @param confirmed_only trueなら確認済みのものだけから選ぶ
+	std::optional<u8> find_newest(const bool confirmed_only = false) noexcept
+	{
+		std::optional<u8> ret{};
+		for(u8 slot = 0; slot < slots.size(); ++slot)
+		{
+			if(!is_bootable(slot) || (confirmed_only && get_trailer(slot).confirmed != flag_set)) continue;
+			if(!ret || get_trailer(slot).sequence > get_trailer(*ret).sequence) ret = slot;
+		}
+		return ret;
+	}
+
+	/// @brief IWDGを始める。止められないので、アプリケーションが更新し続けなければリセットされる
+	void watchdog_start() noexcept
+	{
+		// デバッガで止めている間は数えない
+		DBGMCU->CR = DBGMCU->CR | DBGMCU_CR_DBG_IWDG_STOP;
+
+		IWDG->KR = watchdog_key_start;
+		IWDG->KR = watchdog_key_unlock;
+		IWDG->PR = watchdog_prescaler;
+		IWDG->RLR = watchdog_reload;
+		while(IWDG->SR);
+		IWDG->KR = watchdog_key_reload;
+	}
+
+	[[noreturn]] void jump(const u8 slot) noexcept
+	{
+		can_deinit();
+		clock_deinit();
+
+		const auto * const vector = reinterpret_cast<const u32 *>(slots[slot].address);
+		SCB->VTOR = slots[slot].address;
+		__set_MSP(vector[0]);
+		reinterpret_cast<void (*)()>(vector[1])();
+		while(true);
+	}
+
+	/// @brief 確認されていないスロットはmax_boot_attempts回まで起動する。超えたら却下して次を探す
+	/// @details 確認されていないスロットはIWDGを始めてから起動するので、止まったり例外で止まったりしても、リセットされて回数が増える
+	/// @return 起動できるものがなければnullopt
+	std::optional<u8> choose_slot() noexcept
+	{
+		while(const auto slot = find_newest())
+		{
+			const auto& trailer = get_trailer(*slot);
+			if(trailer.confirmed == flag_set)
+			{
+				backup_register(attempts_register) = 0;
+				return slot;
+			}
+
+			const u32 attempts = backup_register(attempts_register);
+			if(attempts < max_boot_attempts && trailer.crc == calc_crc(*slot, trailer.size))
+			{
+				backup_register(attempts_register) = attempts + 1;
+				watchdog_start();
+				return slot;
+			}
+
+			flash_unlock();
+			(void)flash_program(trailer_address(slots[*slot]) + offsetof(Trailer, rejected), flag_set);
+			flash_lock();
+			backup_register(attempts_register) = 0;
+		}
+		return std::nullopt;
+	}
+
+	/// @brief CANでイメージを受け取る
+	class Receiver final
+	{
+		const u32 reply_id;
+
+		std::optional<u8> target{};
+		u32 size{0};
+		u32 crc{0};
+		u32 offset{0};
+		u8 since_ack{0};
+
+		public:
+		Receiver(const u8 node) noexcept:
+			reply_id(reply_id_base + node)
+		{}
+
+		/// @return Bootを受けたらtrue
+		bool handle(const Received& message) noexcept
+		{
+			if(message.dlc == 0) return false;
+
+			const auto command = static_cast<Command>(message.data[0]);
+			switch(command)
+			{
+				case Command::Query:
+				{
+					const auto newest = find_newest();
+					reply(Status::Ack, command, std::array<u8, 3>{newest ? *newest : (u8)0xFF, next_target(), window});
+				}
+				break;
+
+				case Command::Start:
+				{
+					if(message.dlc < 8)
+					{
+						reply(Status::Error, command);
+						return false;
+					}
+
+					size = message.data[1] << 16 | message.data[2] << 8 | message.data[3];
+					crc = read_u32(message.data, 4);
+					target = next_target();
+					offset = 0;
+					since_ack = 0;
+
+					const auto& slot = slots[*target];
+					bool ok = size != 0 && size <= image_capacity(slot);
+
+					flash_unlock();
+					for(u32 page = slot.address; ok && page < slot.address + slot.size; page += page_size) ok = flash_erase_page(page);
+					flash_lock();
+
+					if(!ok) target.reset();
+					reply(ok ? Status::Ack : Status::Error, command, std::array<u8, 1>{ok ? *target : (u8)0xFF});
+				}
+				break;
+
+				case Command::Data:
+				on_data(message);
+				break;
+
+				case Command::Finish:
+				{
+					// 返事が落ちてホストが送り直したときは、書き終えたTrailerを見てAckを返す
+					const bool ok = target ? offset == size && calc_crc(*target, size) == crc && write_trailer() : is_finished();
+					target.reset();
+					reply(ok ? Status::Ack : Status::Error, command);
+				}
+				break;
+
+				case Command::Boot:
+				reply(Status::Ack, command);
+				while(!(CAN1->TSR & CAN_TSR_TME0));
+				return true;
+
+				default:
+				reply(Status::Error, command);
+			}
+			return false;
+		}
+
+		private:
+		/// @brief 最も新しい確認済みのスロットでない方。確認済みのものがなければ、今起動するスロットでない方
+		/// @details 最も新しいスロットが確認待ちで、確認済みのイメージがもう一方にしかないときに、それを消さないようにする
+		static u8 next_target() noexcept
+		{
+			auto keep = find_newest(true);
+			if(!keep) keep = find_newest();
+			return keep && *keep == 0 ? 1 : 0;
+		}
+
+		bool is_finished() const noexcept
+		{
+			const auto newest = find_newest();
+			return size != 0 && newest && get_trailer(*newest).size == size && get_trailer(*newest).crc == crc;
+		}
+
+		static u32 read_u32(const std::array<u8, 8>& data, const u8 index) noexcept
+		{
+			return (u32)data[index] << 24 | data[index + 1] << 16 | data[index + 2] << 8 | data[index + 3];
+		}
+
+		void on_data(const Received& message) noexcept
+		{
+			if(!target || message.dlc < 2) return;
+
+			// 通し番号が飛んだら、次に欲しいオフセットを知らせる。ホストはそこから送り直す
+			const u8 expected = (offset / data_per_frame) & 0xFF;
+			if(message.data[1] != expected || offset >= size)
+			{
+				since_ack = 0;
+				reply_offset(Status::Nack);
+				return;
+			}
+
+			const u8 length = std::min<u32>(message.dlc - 2, size - offset);
+			const u32 base = slots[*target].address + offset;
+			bool ok = true;
+			flash_unlock();
+			for(u8 i = 0; ok && i < length; i += 2)
+			{
+				// 奇数長の最後は0xFFで埋める
+				const u16 value = message.data[2 + i] | (i + 1 < length ? message.data[3 + i] : 0xFF) << 8;
+				ok = flash_program(base + i, value);
+			}
+			flash_lock();
+
+			if(!ok)
+			{
+				target.reset();
+				reply(Status::Error, Command::Data);
+				return;
+			}
+
+			offset += length;
+			if(++since_ack >= window || offset == size)
+			{
+				since_ack = 0;
+				reply_offset(Status::Ack);
+			}
+		}
+
+		bool write_trailer() noexcept
+		{
+			const auto newest = find_newest();
+			const u16 sequence = newest ? get_trailer(*newest).sequence + 1 : 0;
+			const Trailer trailer{.magic=trailer_magic, .size=size, .crc=crc, .sequence=sequence, .confirmed=flag_clear, .rejected=flag_clear, .reserved=flag_clear};
+
+			const u32 address = trailer_address(slots[*target]);
+			const auto * const halfwords = reinterpret_cast<const u16 *>(&trailer);
+			bool ok = true;
+			flash_unlock();
+			// magicを最後に書くので、途中で電源が落ちたら起動対象にならない
+			for(u32 i = 2; ok && i < sizeof(Trailer) / 2; ++i) ok = flash_program(address + 2 * i, halfwords[i]);
+			for(u32 i = 0; ok && i < 2; ++i) ok = flash_program(address + 2 * i, halfwords[i]);
+			flash_lock();
+
+			// 新しいイメージはまだ確認されていないので、起動回数を数え直す
+			backup_register(attempts_register) = 0;
+			return ok;
+		}
+
+		void reply_offset(const Status status) noexcept
+		{
+			reply(status, Command::Data, std::array<u8, 4>{(u8)(offset >> 24), (u8)(offset >> 16), (u8)(offset >> 8), (u8)offset});
+		}
+
+		template<std::size_t N = 0>
+		void reply(const Status status, const Command command, const std::array<u8, N>& payload = {}) noexcept
+		{
+			static_assert(N <= 6);
+
+			std::array<u8, 8> data{(u8)status, (u8)command};
+			for(u8 i = 0; i < N; ++i) data[2 + i] = payload[i];
+			can_post(reply_id, data, 2 + N);
+		}
+	};
+}
+
+extern "C" [[noreturn]] void Reset_Handler() noexcept
+{
+	// .dataをRAMへ写し、.bssを0にする
+	for(u32 *src = &_sidata, *dst = &_sdata; dst < &_edata;) *dst++ = *src++;
+	for(u32 *dst = &_sbss; dst < &_ebss;) *dst++ = 0;
+
+	backup_enable();
+
+	const bool requested = (backup_register(request_register) & 0xFF'FF) == request_magic;
+	backup_register(request_register) = 0;
+
+	if(!requested)
+	{
+		if(const auto slot = choose_slot(); slot) jump(*slot);
+	}
+
+	// 書き換えを頼まれたか、起動できるスロットがない
+	clock_init();
+	const u8 node = node_id();
+	can_init(node);
+
+	Receiver receiver{node};
+	while(true)
+	{
+		const auto message = can_receive();
+		if(!message || !receiver.handle(*message)) continue;
+
+		// Bootを受けた。リセットして選び直す
+		NVIC_SystemReset();
+	}
+}
+
+extern "C" [[noreturn]] void Default_Handler() noexcept
+{
+	NVIC_SystemReset();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <optional>
+
+#include "main.h"
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief バックアップレジスタ。電源が落ちない限りリセットしても残るので、砲身の位置を置いておく
+	struct BackupDomain final
+	{
+		static constexpr u16 magic = 0xA5'5A;
+
+		static void enable() noexcept
+		{
+			__HAL_RCC_PWR_CLK_ENABLE();
+			__HAL_RCC_BKP_CLK_ENABLE();
+			HAL_PWR_EnableBkUpAccess();
+		}
+
+		/// @brief 電源投入によるリセットでなければtrue。リセット要因のフラグは消す
+		static bool is_warm_boot() noexcept
+		{
+			const bool power_on = __HAL_RCC_GET_FLAG(RCC_FLAG_PORRST);
+			__HAL_RCC_CLEAR_RESET_FLAGS();
+			return !power_on && BKP->DR7 == magic;
+		}
+
+		/// @param position [0, 2^20)程度の非負の値
+		static void save_position(const u8 index, const i32 position) noexcept
+		{
+			volatile u32 * const dr = &BKP->DR1 + 2 * index;
+			dr[0] = static_cast<u32>(position) >> 16;
+			dr[1] = static_cast<u32>(position) & 0xFF'FF;
+			BKP->DR7 = magic;
+		}
+
+		static i32 load_position(const u8 index) noexcept
+		{
+			const volatile u32 * const dr = &BKP->DR1 + 2 * index;
+			return static_cast<i32>((dr[0] & 0xFF'FF) << 16 | (dr[1] & 0xFF'FF));
+		}
+	};
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+
+#include <CRSLibtmp/std_type.hpp>
+#include "ring_buffer.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief 直近の制御データを間引いてリングバッファに記録し続け、トリガで止める
+	/// @details トリガの後もpost_trigger件は記録してから止めるので、何が起きたかの前後が残る。止まっている間は中身が変わらない
+	/// @tparam Record 1件の記録
+	/// @tparam N 記録の件数。RAMに常駐するのでsizeof(Record) * Nに注意
+	template<class Record, std::size_t N>
+	class BlackBox final
+	{
+		public:
+		enum class Trigger : u8
+		{
+			None,
+			Command,
+			Fault,
+			Jam,
+			Watchdog
+		};
+
+		static constexpr std::size_t capacity = N;
+		static constexpr std::size_t post_trigger = N / 4;
+
+		private:
+		RingBuffer<Record, N> records{};
+		u8 decimation;
+		u8 skipped{0};
+
+		Trigger trigger{Trigger::None};
+		std::size_t after_trigger{0};
+
+		public:
+		/// @param decimation 何回に1回記録するか
+		constexpr BlackBox(const u8 decimation) noexcept:
+			decimation(decimation)
+		{}
+
+		/// @brief 制御周期ごとに呼ぶ。trueなら今回の記録をpushする
+		bool is_due() noexcept
+		{
+			if(is_frozen()) return false;
+			if(++skipped < decimation) return false;
+
+			skipped = 0;
+			return true;
+		}
+
+		void push(const Record& record) noexcept
+		{
+			if(is_frozen()) return;
+
+			records.push_overwrite(record);
+			if(trigger != Trigger::None) ++after_trigger;
+		}
+
+		/// @brief 最初のトリガだけを覚える
+		void fire(const Trigger reason) noexcept
+		{
+			if(trigger == Trigger::None) trigger = reason;
+		}
+
+		/// @brief 記録を捨てて、また記録し始める
+		void rearm() noexcept
+		{
+			records.clear();
+			trigger = Trigger::None;
+			after_trigger = 0;
+			skipped = 0;
+		}
+
+		bool is_frozen() const noexcept
+		{
+			return trigger != Trigger::None && after_trigger >= post_trigger;
+		}
+
+		Trigger get_trigger() const noexcept
+		{
+			return trigger;
+		}
+
+		/// @brief トリガの直後に記録したものの番号(古い方から)
+		std::size_t get_trigger_index() const noexcept
+		{
+			return records.size() - after_trigger;
+		}
+
+		void set_decimation(const u8 decimation) noexcept
+		{
+			this->decimation = decimation == 0 ? 1 : decimation;
+		}
+
+		u8 get_decimation() const noexcept
+		{
+			return decimation;
+		}
+
+		std::size_t size() const noexcept
+		{
+			return records.size();
+		}
+
+		/// @brief 古い方から数えてindex番目
+		const Record& operator[](const std::size_t index) const noexcept
+		{
+			return records[index];
+		}
+	};
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+
+#include "main.h"
+
+#include <CRSLibtmp/std_type.hpp>
+#include "boot_layout.hpp"
+#include "backup_domain.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief アプリケーション側からブートローダとやり取りする
+	struct BootControl final
+	{
+		/// @brief 今動いているスロット。ブートローダを通さず書き込んだときなどはnullopt
+		static std::optional<u8> running_slot() noexcept
+		{
+			for(u8 slot = 0; slot < Boot::slots.size(); ++slot)
+			{
+				if(SCB->VTOR == Boot::slots[slot].address) return slot;
+			}
+			return std::nullopt;
+		}
+
+		/// @brief 起動に成功したことを記録する。しないとブートローダはmax_boot_attempts回の後にもう一方のスロットへ戻す
+		static void confirm() noexcept
+		{
+			const auto slot = running_slot();
+			if(!slot) return;
+
+			BackupDomain::enable();
+			BKP->DR8 = 0;
+
+			const u32 address = Boot::trailer_address(Boot::slots[*slot]);
+			const auto& trailer = *reinterpret_cast<const Boot::Trailer *>(address);
+			if(trailer.magic != Boot::trailer_magic || trailer.confirmed == Boot::flag_set) return;
+
+			HAL_FLASH_Unlock();
+			(void)HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + offsetof(Boot::Trailer, confirmed), Boot::flag_set);
+			HAL_FLASH_Lock();
+		}
+
+		/// @brief ブートローダが始めたIWDGを更新する。始まっていなければ何もしない
+		static void refresh_watchdog() noexcept
+		{
+			IWDG->KR = Boot::watchdog_key_reload;
+		}
+
+		/// @brief リセットしてブートローダに留まらせる。戻らない
+		[[noreturn]] static void enter_bootloader() noexcept
+		{
+			BackupDomain::enable();
+			BKP->DR9 = Boot::request_magic;
+			NVIC_SystemReset();
+		}
+	};
+}
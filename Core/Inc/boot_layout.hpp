@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+
+#include <CRSLibtmp/std_type.hpp>
+
+// ブートローダ(Bootloader/)とアプリケーションで共有する、フラッシュの配置とCANでの書き換えの取り決め
+namespace Nhk23Servo::Boot
+{
+	using namespace CRSLib::IntegerTypes;
+
+	// 0x0800'0000~0x0800'1FFF: ブートローダ
+	// 0x0800'2000~0x0800'8BFF: スロットA
+	// 0x0800'8C00~0x0800'F7FF: スロットB
+	// 0x0800'F800~0x0800'FFFF: パラメータ(param_store.hpp)
+	constexpr u32 bootloader_address = 0x0800'0000;
+	constexpr u32 bootloader_size = 8 * 1024;
+	constexpr u32 page_size = 0x400;
+
+	struct Slot final
+	{
+		u32 address;
+		u32 size;
+	};
+	// アプリケーションはスロットごとに別のリンカスクリプトでリンクする(STM32F103C8TX_FLASH.ld, STM32F103C8TX_FLASH_SLOT_B.ld)
+	constexpr std::array<Slot, 2> slots{{{0x0800'2000, 27 * 1024}, {0x0800'8C00, 27 * 1024}}};
+
+	/// @brief スロットの最後に置く。ブートローダがイメージのCRCを確かめてから書く
+	/// @details confirmedとrejectedは0xFFFFから0x0000へ1回だけ書ける
+	struct Trailer final
+	{
+		u32 magic;
+		u32 size;
+		u32 crc;
+		u16 sequence;  // 大きい方が新しい
+		u16 confirmed;  // 0ならアプリケーションが起動に成功した
+		u16 rejected;  // 0なら確認されないままmax_boot_attempts回起動したので使わない
+		u16 reserved;
+	};
+	static_assert(sizeof(Trailer) == 20);
+
+	constexpr u32 trailer_magic = 0x4E'48'4B'42;  // "NHKB"
+	constexpr u16 flag_set = 0x00'00;
+	constexpr u16 flag_clear = 0xFF'FF;
+
+	constexpr u32 trailer_address(const Slot& slot) noexcept
+	{
+		return slot.address + slot.size - sizeof(Trailer);
+	}
+
+	constexpr u32 image_capacity(const Slot& slot) noexcept
+	{
+		return slot.size - sizeof(Trailer);
+	}
+
+	// 確認されないまま起動できる回数。超えたらもう一方のスロットに戻る
+	constexpr u8 max_boot_attempts = 3;
+
+	// 確認されていないスロットへ飛ぶ前にIWDGを始める。止まったイメージはリセットされ、起動回数が増える
+	// アプリケーションはメインループで更新する(BootControl::refresh_watchdog)。始めたIWDGはリセットまで止まらない
+	// LSI(約40kHz)の64分周で1250カウント、約2秒。LSIは30~60kHzなので1.3~2.7秒
+	constexpr u32 watchdog_prescaler = 4;  // IWDG_PR。64分周
+	constexpr u32 watchdog_reload = 1250;
+	constexpr u32 watchdog_key_start = 0xCC'CC;
+	constexpr u32 watchdog_key_unlock = 0x55'55;
+	constexpr u32 watchdog_key_reload = 0xAA'AA;
+
+	// バックアップレジスタ。DR1~DR7はbackup_domain.hppが使う
+	constexpr u8 attempts_register = 8;  // 確認されていないスロットを起動した回数。VBATがないので電源を切ると0に戻るが、IWDGによるリセットでは残る
+	constexpr u8 request_register = 9;  // request_magicならブートローダに留まる
+	constexpr u16 request_magic = 0xB0'07;
+
+	// CANのビットタイミング。アプリケーションはCubeMXの設定(nhk23_servo.ioc、Core/Src/can.cのMX_CAN_Init)で同じ値にしているので、変えるときは両方を合わせる
+	// APB1(36MHz)を16分周し、SJW 1tq、BS1 1tq、BS2 1tqの3tqで750kbps
+	constexpr u32 can_clock = 36'000'000;
+	constexpr u32 can_prescaler = 16;
+	constexpr u32 can_sjw_tq = 1;
+	constexpr u32 can_bs1_tq = 1;
+	constexpr u32 can_bs2_tq = 1;
+	constexpr u32 can_bit_rate = can_clock / (can_prescaler * (1 + can_bs1_tq + can_bs2_tq));
+	static_assert(can_bit_rate == 750'000);
+
+	// CAN。ノード番号はオプションバイトのData0(未設定なら0)
+	constexpr u32 command_id_base = 0x700;  // +ノード番号。ホスト->ボード
+	constexpr u32 reply_id_base = 0x780;  // +ノード番号。ボード->ホスト
+	constexpr u8 node_max = 0x7F;
+
+	// [0]がCommand
+	enum class Command : u8
+	{
+		Query,  // -> [2]: 起動するスロット(0xFFなら無し), [3]: 次に書くスロット, [4]: window
+		Start,  // [1-3]: サイズ, [4-7]: CRC32 -> [2]: 書くスロット。スロットを消去してから返す
+		Data,  // [1]: 通し番号(下位8bit), [2-7]: データ。windowフレームごとと最後に[2-5]: 次のオフセットを返す
+		Finish,  // CRCを確かめてTrailerを書く
+		Boot  // 返事をしてから起動する
+	};
+
+	// 返事の[0]。[1]は受けたCommand
+	enum class Status : u8
+	{
+		Ack,
+		Nack,  // 通し番号が飛んだ。[2-5]: 次に欲しいオフセット
+		Error
+	};
+
+	constexpr u8 data_per_frame = 6;
+	constexpr u8 window = 16;
+
+	/// @brief CRC-32(IEEE 802.3)。4bitずつ表を引く
+	class Crc32 final
+	{
+		static constexpr std::array<u32, 16> table = []() constexpr
+		{
+			std::array<u32, 16> ret{};
+			for(u32 i = 0; i < 16; ++i)
+			{
+				u32 crc = i;
+				for(u8 j = 0; j < 4; ++j) crc = crc & 1 ? (crc >> 1) ^ 0xEDB8'8320 : crc >> 1;
+				ret[i] = crc;
+			}
+			return ret;
+		}();
+
+		u32 crc{0xFFFF'FFFF};
+
+		public:
+		constexpr void update(const u8 octet) noexcept
+		{
+			crc = table[(crc ^ octet) & 0xF] ^ (crc >> 4);
+			crc = table[(crc ^ (octet >> 4)) & 0xF] ^ (crc >> 4);
+		}
+
+		constexpr u32 get() const noexcept
+		{
+			return ~crc;
+		}
+	};
+}
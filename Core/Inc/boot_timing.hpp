@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+
+#include <CRSLibtmp/std_type.hpp>
+#include "cycle_counter.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief main()に入ってから各段階に着くまでの時間。サイクルカウンタはmain()の最初で0にする
+	/// @attention SystemClock_Configまではリセット直後のHSI(8MHz)で動いているので、そこまでとそれ以降で換算を変える
+	class BootTiming final
+	{
+		public:
+		enum Mark : u8
+		{
+			ClockReady,  // SystemClock_Configの後
+			CanReady,  // CANがNormalModeになった
+			FirstReceive,  // 最初のフレームを受信した
+			FirstPost,  // 最初にC620へ電流指令値を送信した
+			FirstCommand,  // 最初に上位から指令(サーボ、射出、同時射出、原点出し、ハートビート)を受けた。C620のフィードバックは含まない
+
+			N
+		};
+
+		static constexpr u32 hsi_cycles_per_us = 8;
+
+		private:
+		std::array<u32, N> cycles{};
+		std::array<bool, N> marked{};
+
+		public:
+		/// @brief 最初の1回だけ記録する
+		void mark(const Mark mark) noexcept
+		{
+			if(marked[mark]) return;
+
+			cycles[mark] = CycleCounter::now();
+			marked[mark] = true;
+		}
+
+		bool is_marked(const Mark mark) const noexcept
+		{
+			return marked[mark];
+		}
+
+		/// @brief main()に入ってからの時間[us]
+		u32 get_us(const Mark mark) const noexcept
+		{
+			const u32 clock_us = cycles[ClockReady] / hsi_cycles_per_us;
+			if(mark == ClockReady) return clock_us;
+			return clock_us + (cycles[mark] - cycles[ClockReady]) / CycleCounter::cycles_per_us;
+		}
+	};
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <optional>
+
+#include <CRSLibtmp/std_type.hpp>
+#include <CRSLibtmp/Can/Stm32/RM0008/can_bus.hpp>
+#include "cycle_counter.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief 送るデータ。readはoffsetバイト目を返す。送っている間に中身が変わらないようにするのは呼ぶ側
+	struct BulkSource final
+	{
+		u32 size;
+		byte (*read)(u32 offset) noexcept;
+	};
+
+	/// @brief 8byteを超えるデータをISO-TP(ISO 15765-2)と同じ形で分割して送る
+	/// @details [0]の上位4bitで種類を分ける
+	/// - 0x0L: Single Frame。L(1~7)byteのデータが続く
+	/// - 0x1L LL: First Frame。長さ12bit。0x10 0x00なら[2-5]が長さ(32bit)。残りはデータ
+	/// - 0x2N: Consecutive Frame。Nは1から始まる通し番号(下位4bit)。7byteのデータが続く
+	/// - 0x3S BS ST: Flow Control(受信側から)。S=0で続けて良い、1で待て、2で中止。BSフレームごとにFlow Controlを待つ(0なら待たない)。
+	///   STはフレームの間隔の下限で、0x00~0x7Fならms、0xF1~0xF9なら100~900us
+	/// 制御の通信を遅らせないよう、呼ぶ側は送信メールボックスが全て空いているときだけ1フレームずつ送る。
+	/// 途中から送り直すときは、startにオフセットを渡す。そこから後ろだけを1つのデータとして、First Frameから送る
+	class BulkSender final
+	{
+		enum class Phase : u8
+		{
+			Idle,
+			WaitFlowControl,
+			Sending
+		};
+
+		// Flow Controlを待つ時間(ISO-TPのN_Bs)
+		static constexpr u32 flow_control_timeout_us = 1'000'000;
+
+		BulkSource source{};
+		u32 base{0};  // 送るのはsourceのこのバイト目から
+		u32 size{0};  // source.size - base
+		Phase phase{Phase::Idle};
+		u32 offset{0};  // baseから
+		u8 sequence{0};
+		u8 block_size{0};
+		u8 block_left{0};
+		u32 separation_cycles{0};
+		u32 last_cycle{0};
+
+		u16 completed{0};
+		u16 aborted{0};
+
+		public:
+		/// @brief 送り始める。送っている途中なら何もしない
+		/// @param base このバイト目から後ろを送る。受信側が途中まで受け取れていたとき用
+		bool start(const BulkSource& source, const u32 base = 0) noexcept
+		{
+			if(phase != Phase::Idle || base >= source.size) return false;
+
+			this->source = source;
+			this->base = base;
+			size = source.size - base;
+			offset = 0;
+			sequence = 0;
+			phase = Phase::Sending;
+			return true;
+		}
+
+		/// @brief 受信側からのFlow Controlを渡す
+		void on_flow_control(const CRSLib::Can::DataField& data, const u32 now) noexcept
+		{
+			if(phase != Phase::WaitFlowControl || data.dlc < 3) return;
+
+			switch((u8)data.buffer[0])
+			{
+				case 0x30:
+				block_size = (u8)data.buffer[1];
+				block_left = block_size;
+				separation_cycles = to_cycles((u8)data.buffer[2]);
+				// 最初のConsecutive Frameはすぐに送って良い
+				last_cycle = now - separation_cycles;
+				phase = Phase::Sending;
+				break;
+
+				case 0x31:
+				last_cycle = now;
+				break;
+
+				default:
+				abort();
+			}
+		}
+
+		/// @brief 今送るフレーム。送れたらadvanceを呼ぶ
+		/// @param now CycleCounter::now()
+		std::optional<CRSLib::Can::DataField> peek(const u32 now) noexcept
+		{
+			switch(phase)
+			{
+				case Phase::Idle:
+				return std::nullopt;
+
+				case Phase::WaitFlowControl:
+				if(now - last_cycle > flow_control_timeout_us * CycleCounter::cycles_per_us) abort();
+				return std::nullopt;
+
+				case Phase::Sending:
+				break;
+			}
+
+			CRSLib::Can::DataField data{.buffer={}, .dlc=8};
+			if(offset == 0)
+			{
+				if(size <= 7)
+				{
+					data.buffer[0] = (byte)size;
+					fill(data, 1, size);
+					data.dlc = 1 + size;
+				}
+				else if(size <= 0xF'FF)
+				{
+					data.buffer[0] = (byte)(0x10 | size >> 8);
+					data.buffer[1] = (byte)size;
+					fill(data, 2, 6);
+				}
+				else
+				{
+					data.buffer[0] = (byte)0x10;
+					data.buffer[1] = (byte)0x00;
+					for(u8 i = 0; i < 4; ++i) data.buffer[2 + i] = (byte)(size >> (24 - 8 * i));
+					fill(data, 6, 2);
+				}
+				return data;
+			}
+
+			if(now - last_cycle < separation_cycles) return std::nullopt;
+
+			const u32 length = std::min<u32>(7, size - offset);
+			data.buffer[0] = (byte)(0x20 | (sequence & 0xF));
+			fill(data, 1, length);
+			data.dlc = 1 + length;
+			return data;
+		}
+
+		/// @brief peekで得たフレームを送れた
+		void advance(const u32 now) noexcept
+		{
+			if(phase != Phase::Sending) return;
+
+			if(offset == 0)
+			{
+				offset = size <= 7 ? size : size <= 0xF'FF ? 6 : 2;
+				sequence = 1;
+				if(offset >= size)
+				{
+					finish();
+					return;
+				}
+				last_cycle = now;
+				phase = Phase::WaitFlowControl;
+				return;
+			}
+
+			offset += std::min<u32>(7, size - offset);
+			++sequence;
+			last_cycle = now;
+
+			if(offset >= size)
+			{
+				finish();
+			}
+			else if(block_size != 0 && --block_left == 0)
+			{
+				phase = Phase::WaitFlowControl;
+			}
+		}
+
+		void abort() noexcept
+		{
+			if(phase == Phase::Idle) return;
+			phase = Phase::Idle;
+			++aborted;
+		}
+
+		bool is_busy() const noexcept
+		{
+			return phase != Phase::Idle;
+		}
+
+		u16 get_completed() const noexcept
+		{
+			return completed;
+		}
+
+		u16 get_aborted() const noexcept
+		{
+			return aborted;
+		}
+
+		private:
+		void finish() noexcept
+		{
+			phase = Phase::Idle;
+			++completed;
+		}
+
+		void fill(CRSLib::Can::DataField& data, const u8 index, const u32 length) const noexcept
+		{
+			for(u8 i = 0; i < length; ++i) data.buffer[index + i] = source.read(base + offset + i);
+		}
+
+		static constexpr u32 to_cycles(const u8 separation_time) noexcept
+		{
+			if(separation_time <= 0x7F) return separation_time * 1000 * CycleCounter::cycles_per_us;
+			if(0xF1 <= separation_time && separation_time <= 0xF9) return (separation_time - 0xF0) * 100 * CycleCounter::cycles_per_us;
+			// 予約された値は最も長い間隔とみなす(ISO 15765-2)
+			return 127 * 1000 * CycleCounter::cycles_per_us;
+		}
+	};
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+
+#include "main.h"
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief 受信FIFOごとの数。receivedのうち、どのコールバックにも渡さなかったものがdropped
+	struct FifoCounters final
+	{
+		u32 received{0};
+		u32 dispatched{0};
+		u16 overruns{0};  // FOVRが立った回数。溢れたフレームの数ではない
+		u16 fulls{0};  // FULLが立った回数
+
+		u32 dropped() const noexcept
+		{
+			return received - dispatched;
+		}
+
+		/// @brief RFxRのFOVRとFULLを数えてクリアする。ドライバによらずメインループから呼ぶ
+		/// @details RFOMには0を書くので、FIFOは解放しない
+		void check_flags(volatile u32& rfr) noexcept
+		{
+			const u32 flags = rfr & (CAN_RF0R_FOVR0 | CAN_RF0R_FULL0);
+			if(flags == 0) return;
+
+			if(flags & CAN_RF0R_FOVR0) ++overruns;
+			if(flags & CAN_RF0R_FULL0) ++fulls;
+			rfr = flags;
+		}
+	};
+
+	/// @brief チャンネルごとに届いたフレームを数え、window_msごとに1秒あたりの数にする
+	template<u8 N>
+	class RateMeter final
+	{
+		static constexpr u32 window_ms = 1000;
+
+		std::array<u32, N> counts{};
+		std::array<u32, N> window_counts{};
+		std::array<u16, N> rates{};
+		u32 window_start_ms{0};
+
+		public:
+		void count(const u8 channel) noexcept
+		{
+			++counts[channel];
+		}
+
+		/// @brief 制御周期ごとに呼ぶ
+		void update(const u32 now_ms) noexcept
+		{
+			const u32 elapsed = now_ms - window_start_ms;
+			if(elapsed < window_ms) return;
+
+			for(u8 i = 0; i < N; ++i)
+			{
+				rates[i] = (counts[i] - window_counts[i]) * 1000 / elapsed;
+				window_counts[i] = counts[i];
+			}
+			window_start_ms = now_ms;
+		}
+
+		/// @brief 直前のwindow_msでの1秒あたりの数
+		u16 get_rate(const u8 channel) const noexcept
+		{
+			return rates[channel];
+		}
+
+		u32 get_count(const u8 channel) const noexcept
+		{
+			return counts[channel];
+		}
+	};
+}
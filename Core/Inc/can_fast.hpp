@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <optional>
+
+#include "main.h"
+
+#include <CRSLibtmp/std_type.hpp>
+#include <CRSLibtmp/Can/Stm32/RM0008/can_bus.hpp>
+#include "ram_func.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+	using namespace CRSLib::Can::Stm32::RM0008;
+
+	/// @brief bxCANのメールボックスを直接読み書きする送受信。CanBusと同じreceive/postを持つ
+	/// @attention 初期化とNormalModeへの移行はしないので、先にCanBusを作っておくこと
+	class CanFast final
+	{
+		CAN_TypeDef& can;
+
+		public:
+		CanFast(CAN_TypeDef& can) noexcept:
+			can(can)
+		{}
+
+		/// @brief FIFOの先頭を読み出して解放する
+		NHK23_SERVO_RAM_FUNC std::optional<ReceivedMessage> receive(const Fifo fifo) noexcept
+		{
+			const u8 index = static_cast<u8>(fifo);
+			volatile u32& rfr = index == 0 ? can.RF0R : can.RF1R;
+			if((rfr & CAN_RF0R_FMP0) == 0) return std::nullopt;
+
+			const auto& mailbox = can.sFIFOMailBox[index];
+			const u32 rir = mailbox.RIR;
+			const u32 rdlr = mailbox.RDLR;
+			const u32 rdhr = mailbox.RDHR;
+
+			ReceivedMessage message{};
+			message.id = (rir & CAN_RI0R_IDE) ? rir >> CAN_RI0R_EXID_Pos : rir >> CAN_RI0R_STID_Pos;
+			// DLCの9~15は8byteとして扱う。dlcより後ろは前のフレームの残りなので0にする
+			message.data.dlc = std::min<u32>(mailbox.RDTR & CAN_RDT0R_DLC, 8);
+			for(u8 i = 0; i < 4; ++i)
+			{
+				if(i < message.data.dlc) message.data.buffer[i] = static_cast<byte>(rdlr >> (8 * i));
+				if(4 + i < message.data.dlc) message.data.buffer[4 + i] = static_cast<byte>(rdhr >> (8 * i));
+			}
+
+			// RFOMだけを書く。FULLとFOVRは1を書くとクリアされるので|=にしない
+			rfr = CAN_RF0R_RFOM0;
+			return message;
+		}
+
+		/// @brief 空いている送信メールボックスに書いて送信を要求する。空きがなければfalse
+		NHK23_SERVO_RAM_FUNC bool post(const u32 id, const CRSLib::Can::DataField& data) noexcept
+		{
+			const u32 tsr = can.TSR;
+			if((tsr & (CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2)) == 0) return false;
+
+			// CODEは空いているメールボックスの番号
+			auto& mailbox = can.sTxMailBox[(tsr & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos];
+
+			u32 tdlr = 0;
+			u32 tdhr = 0;
+			for(u8 i = 0; i < 4; ++i)
+			{
+				tdlr |= static_cast<u32>(data.buffer[i]) << (8 * i);
+				tdhr |= static_cast<u32>(data.buffer[4 + i]) << (8 * i);
+			}
+
+			mailbox.TDTR = data.dlc & CAN_TDT0R_DLC;
+			mailbox.TDLR = tdlr;
+			mailbox.TDHR = tdhr;
+			// 標準IDに収まらなければ拡張ID
+			mailbox.TIR = (id <= 0x7FF ? id << CAN_TI0R_STID_Pos : id << CAN_TI0R_EXID_Pos | CAN_TI0R_IDE) | CAN_TI0R_TXRQ;
+			return true;
+		}
+	};
+}
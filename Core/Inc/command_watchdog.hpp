@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief チャンネルごとに最後に指令を受けた時刻を見て、指令が途絶えたら電流を0まで下げる
+	/// @details ハートビートを一度も受けていない間は何も見ない。ハートビートを送らない上位では、指令の合間を途絶えたと取り違えるため。
+	/// その後も、一度も指令を受けていないチャンネルは見ない。checkは制御周期ごとに呼び、比較と引き算しかしない
+	/// @tparam N チャンネル数(16以下)
+	template<u8 N>
+	class CommandWatchdog final
+	{
+		static_assert(N <= 16);
+
+		u32 timeout_ms;
+		// 制御周期ごとに電流の上限をこれだけ下げる
+		i16 ramp_step;
+
+		std::array<u32, N> fed_ms{};
+		std::array<i16, N> limit{};
+		u16 commanded_mask{0};  // 指令を受けたことのあるチャンネル
+		u16 armed_mask{0};  // ハートビートを受けてからはcommanded_maskと同じ
+		u16 expired_mask{0};
+		u16 expired_count{0};
+		bool heartbeat_received{false};
+
+		public:
+		/// @param timeout_ms 0なら止めない
+		constexpr CommandWatchdog(const u32 timeout_ms, const i16 ramp_step) noexcept:
+			timeout_ms(timeout_ms),
+			ramp_step(ramp_step)
+		{}
+
+		/// @brief 指令を受けたチャンネルのビット集合を渡す
+		void feed(const u16 mask, const u32 now) noexcept
+		{
+			for(u8 i = 0; i < N; ++i)
+			{
+				if(mask >> i & 1u) fed_ms[i] = now;
+			}
+			commanded_mask |= mask & all_mask;
+			if(heartbeat_received) armed_mask = commanded_mask;
+			expired_mask &= ~mask;
+		}
+
+		/// @brief ハートビート。指令を受けたことのあるチャンネルだけ延長する。最初のハートビートでそれらを見始める
+		void feed_heartbeat(const u32 now) noexcept
+		{
+			heartbeat_received = true;
+			feed(commanded_mask, now);
+		}
+
+		/// @brief 制御周期ごとに呼ぶ
+		/// @return 今回途絶えたチャンネルのビット集合
+		u16 check(const u32 now) noexcept
+		{
+			u16 newly_expired = 0;
+			for(u8 i = 0; i < N; ++i)
+			{
+				const u16 bit = 1u << i;
+				if(expired_mask & bit)
+				{
+					limit[i] = std::max<i16>(0, limit[i] - ramp_step);
+				}
+				else if(timeout_ms != 0 && (armed_mask & bit) && now - fed_ms[i] > timeout_ms)
+				{
+					newly_expired |= bit;
+					limit[i] = max_limit;
+				}
+			}
+			expired_mask |= newly_expired;
+			if(newly_expired) ++expired_count;
+			return newly_expired;
+		}
+
+		/// @brief 途絶えたチャンネルの電流を上限で抑える。上限は途絶えたときの電流から0まで下がっていく
+		i16 clamp(const u8 channel, const i16 current) noexcept
+		{
+			if(!is_expired(channel)) return current;
+
+			auto& channel_limit = limit[channel];
+			channel_limit = std::min<i16>(channel_limit, std::abs(current));
+			return std::max<i16>(-channel_limit, std::min<i16>(channel_limit, current));
+		}
+
+		bool is_expired(const u8 channel) const noexcept
+		{
+			return expired_mask >> channel & 1u;
+		}
+
+		void set_timeout_ms(const u32 timeout_ms) noexcept
+		{
+			this->timeout_ms = timeout_ms;
+		}
+
+		u32 get_timeout_ms() const noexcept
+		{
+			return timeout_ms;
+		}
+
+		/// @brief 途絶えた回数。同時に途絶えたチャンネルは1回と数える
+		u16 get_expired_count() const noexcept
+		{
+			return expired_count;
+		}
+
+		u16 get_expired_mask() const noexcept
+		{
+			return expired_mask;
+		}
+
+		private:
+		static constexpr u16 all_mask = (1u << N) - 1;
+		static constexpr i16 max_limit = 0x7F'FF;
+	};
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "main.h"
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief DWTのサイクルカウンタ。72MHzなら約59秒で一周するので、差分だけを使うこと
+	struct CycleCounter final
+	{
+		static constexpr u32 cycles_per_us = 72;
+
+		static void enable() noexcept
+		{
+			CoreDebug->DEMCR = CoreDebug->DEMCR | CoreDebug_DEMCR_TRCENA_Msk;
+			DWT->CYCCNT = 0;
+			DWT->CTRL = DWT->CTRL | DWT_CTRL_CYCCNTENA_Msk;
+		}
+
+		static u32 now() noexcept
+		{
+			return DWT->CYCCNT;
+		}
+	};
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief 処理にかかったサイクル数の最小、最大、平均。max - minがジッタ
+	struct CycleStats final
+	{
+		u32 min{std::numeric_limits<u32>::max()};
+		u32 max{0};
+		u32 sum{0};
+		u32 count{0};
+
+		void add(const u32 cycles) noexcept
+		{
+			// 溢れる前に数え直す。このサンプルをmin/maxに残すよう、更新より先に行う
+			if(sum > std::numeric_limits<u32>::max() - cycles) reset();
+			min = std::min(min, cycles);
+			max = std::max(max, cycles);
+			sum += cycles;
+			++count;
+		}
+
+		u32 mean() const noexcept
+		{
+			return count == 0 ? 0 : sum / count;
+		}
+
+		void reset() noexcept
+		{
+			*this = CycleStats{};
+		}
+	};
+}
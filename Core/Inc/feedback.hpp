@@ -11,5 +11,6 @@ namespace Nhk23Servo
 		i16 angle{0};
 		i16 speed{0};
 		i16 current{0};
+		u8 temperature{0};
 	};
 }
\ No newline at end of file
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <optional>
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief 速度制御のフィードフォワード項。目標速度と目標加速度から電流を見積もる
+	/// @details 電流 = kv * 速度 + ka * 加速度 + kc * sign(速度)。粘性摩擦は速度に比例するのでkvに含める。
+	/// 加速度は1制御周期あたりの目標速度の変化
+	struct Feedforward final
+	{
+		float kv{0.0f};
+		float ka{0.0f};
+		float kc{0.0f};  // クーロン摩擦
+
+		enum Coefficient : u8
+		{
+			Kv,
+			Ka,
+			Kc,
+
+			N
+		};
+
+		float calc(const i16 speed, const i16 acceleration) const noexcept
+		{
+			const float sign = speed > 0 ? 1.0f : speed < 0 ? -1.0f : 0.0f;
+			return kv * speed + ka * acceleration + kc * sign;
+		}
+
+		float& operator[](const Coefficient coefficient) noexcept
+		{
+			return coefficient == Kv ? kv : coefficient == Ka ? ka : kc;
+		}
+	};
+
+	/// @brief 記録した(速度, 電流)の列から最小二乗法でFeedforwardの係数を求める
+	class FeedforwardFit final
+	{
+		std::array<std::array<float, 3>, 3> xtx{};
+		std::array<float, 3> xty{};
+		u32 count{0};
+
+		public:
+		/// @param speed 連続する3サンプルの速度
+		/// @param current 真ん中のサンプルの電流
+		void add(const i16 previous_speed, const i16 speed, const i16 next_speed, const i16 current) noexcept
+		{
+			const float acceleration = (next_speed - previous_speed) / 2.0f;
+			const float sign = speed > 0 ? 1.0f : speed < 0 ? -1.0f : 0.0f;
+			const std::array<float, 3> x{static_cast<float>(speed), acceleration, sign};
+
+			for(u8 i = 0; i < 3; ++i)
+			{
+				for(u8 j = 0; j < 3; ++j) xtx[i][j] += x[i] * x[j];
+				xty[i] += x[i] * current;
+			}
+			++count;
+		}
+
+		/// @brief 正規方程式を部分ピボット付きのガウスの消去法で解く。励起が足りず解けなければnullopt
+		std::optional<Feedforward> solve() const noexcept
+		{
+			if(count < 3) return std::nullopt;
+
+			auto a = xtx;
+			auto b = xty;
+			for(u8 column = 0; column < 3; ++column)
+			{
+				u8 pivot = column;
+				for(u8 row = column + 1; row < 3; ++row)
+				{
+					if(std::abs(a[row][column]) > std::abs(a[pivot][column])) pivot = row;
+				}
+				if(std::abs(a[pivot][column]) < 1e-6f) return std::nullopt;
+				std::swap(a[column], a[pivot]);
+				std::swap(b[column], b[pivot]);
+
+				for(u8 row = column + 1; row < 3; ++row)
+				{
+					const float ratio = a[row][column] / a[column][column];
+					for(u8 k = column; k < 3; ++k) a[row][k] -= ratio * a[column][k];
+					b[row] -= ratio * b[column];
+				}
+			}
+
+			std::array<float, 3> x{};
+			for(i32 row = 2; row >= 0; --row)
+			{
+				float sum = b[row];
+				for(u8 k = row + 1; k < 3; ++k) sum -= a[row][k] * x[k];
+				x[row] = sum / a[row][row];
+			}
+
+			return Feedforward{.kv=x[0], .ka=x[1], .kc=x[2]};
+		}
+	};
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <optional>
+
+#include <CRSLibtmp/std_type.hpp>
+#include "injector.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief 複数のインジェクターを同じ制御tickで射出する
+	template<std::size_t N>
+	class GroupFire final
+	{
+		public:
+		enum class Result : u8
+		{
+			Fired,
+			Timeout
+		};
+
+		struct Report final
+		{
+			u8 mask;
+			Result result;
+			u32 skew_cycles;  // Injectingへの遷移時刻の最大と最小の差
+		};
+
+		static constexpr u32 timeout_ms = 1000;
+
+		private:
+		u8 mask{0};
+		i16 speed{0};
+		u32 armed_time{0};
+		std::optional<Report> report{};
+
+		public:
+		/// @param mask 射出するインジェクターのビット集合
+		void arm(const u8 mask, const i16 speed, const u32 now) noexcept
+		{
+			this->mask = mask & ((1u << N) - 1);
+			this->speed = speed;
+			armed_time = now;
+		}
+
+		bool is_armed() const noexcept
+		{
+			return mask != 0;
+		}
+
+		/// @brief 制御tickの最初、run_and_calc_targetより前に呼ぶ。対象が全てIdleになったら同時に射出する
+		void run(std::array<Injector, N>& injectors, const u32 now) noexcept
+		{
+			if(!is_armed()) return;
+
+			bool ready = true;
+			for(std::size_t i = 0; i < N; ++i)
+			{
+				if((mask >> i & 1u) && !injectors[i].is_ready()) ready = false;
+			}
+
+			if(!ready)
+			{
+				if(now - armed_time >= timeout_ms)
+				{
+					report = Report{.mask=mask, .result=Result::Timeout, .skew_cycles=0};
+					mask = 0;
+				}
+				return;
+			}
+
+			for(std::size_t i = 0; i < N; ++i)
+			{
+				if(mask >> i & 1u) injectors[i].fire_now(speed, now);
+			}
+
+			// 番号順に遷移させたので、最初の遷移からの差の最大がずれ
+			std::optional<u32> first{};
+			u32 skew = 0;
+			for(std::size_t i = 0; i < N; ++i)
+			{
+				if(!(mask >> i & 1u)) continue;
+
+				const u32 cycle = injectors[i].get_injection_start_cycle();
+				if(!first) first = cycle;
+				skew = std::max(skew, cycle - *first);
+			}
+
+			report = Report{.mask=mask, .result=Result::Fired, .skew_cycles=skew};
+			mask = 0;
+		}
+
+		/// @brief 状態機械を通さず、1つのフレームで同時に電流指令を送ったときの報告。ずれは0
+		void fired_together(const u8 mask) noexcept
+		{
+			report = Report{.mask=mask, .result=Result::Fired, .skew_cycles=0};
+		}
+
+		std::optional<Report> take_report() noexcept
+		{
+			const auto ret = report;
+			report.reset();
+			return ret;
+		}
+	};
+}
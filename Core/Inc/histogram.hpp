@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief 対数目盛りの度数分布。1オクターブを2^SubBits個に分けるので、百分位数の誤差は1/2^SubBits以下
+	/// @details addはビット演算と配列の加算だけで、割り算をしない。2^(Octaves + SubBits)以上は最後の区間に入れる
+	template<u8 Octaves = 16, u8 SubBits = 2>
+	class LogHistogram final
+	{
+		static constexpr u32 sub_n = 1u << SubBits;
+		static constexpr std::size_t bucket_n = (Octaves + 1) * sub_n;
+
+		std::array<u32, bucket_n> counts{};
+		u32 count{0};
+		u32 max{0};
+
+		public:
+		void add(const u32 value) noexcept
+		{
+			++counts[index(value)];
+			++count;
+			if(value > max) max = value;
+		}
+
+		/// @brief 小さい方からper_mille/1000の位置にある値の上限。空なら0
+		u32 percentile(const u16 per_mille) const noexcept
+		{
+			if(count == 0) return 0;
+
+			const u64 target = (static_cast<u64>(count) * per_mille + 999) / 1000;
+			u64 cumulative = 0;
+			for(std::size_t i = 0; i < bucket_n; ++i)
+			{
+				cumulative += counts[i];
+				// 最後の区間は上限がないのでmaxを返す
+				if(cumulative >= target) return i + 1 < bucket_n ? std::min(upper_bound(i), max) : max;
+			}
+			return max;
+		}
+
+		u32 get_max() const noexcept
+		{
+			return max;
+		}
+
+		u32 get_count() const noexcept
+		{
+			return count;
+		}
+
+		void reset() noexcept
+		{
+			counts = {};
+			count = 0;
+			max = 0;
+		}
+
+		private:
+		static constexpr std::size_t index(const u32 value) noexcept
+		{
+			// sub_n未満はそのまま
+			if(value < sub_n) return value;
+
+			const u32 msb = std::bit_width(value) - 1;
+			const u32 octave = msb - SubBits + 1;
+			const u32 sub = (value >> (msb - SubBits)) & (sub_n - 1);
+			const std::size_t ret = octave * sub_n + sub;
+			return ret < bucket_n ? ret : bucket_n - 1;
+		}
+
+		static constexpr u32 upper_bound(const std::size_t bucket) noexcept
+		{
+			if(bucket < sub_n) return bucket;
+
+			const u32 shift = bucket / sub_n - 1;
+			const u32 lower = static_cast<u32>(sub_n + bucket % sub_n) << shift;
+			return lower + (1u << shift) - 1;
+		}
+
+		static_assert(index(sub_n) == sub_n && index((sub_n << 1) - 1) == (sub_n << 1) - 1);
+		static_assert(upper_bound(index(1000)) >= 1000 && upper_bound(index(1000) - 1) < 1000);
+	};
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numbers>
+#include <optional>
+
+#include <CRSLibtmp/std_type.hpp>
+#include "feedback.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief システム同定用に、1つのモーターへ励起信号(チャープ/PRBS)を電流指令として注入し、入出力を記録する
+	class Identification final
+	{
+		public:
+		enum class Excitation : u8
+		{
+			Chirp,
+			Prbs
+		};
+
+		struct Config final
+		{
+			Excitation excitation{Excitation::Chirp};
+			u8 motor{0};
+			i16 amplitude{0};
+			u16 length{0};  // 注入するtick数。capacityで打ち切る
+
+			// Chirp: 周波数を[f_start, f_end]で線形に掃引する[Hz]
+			float f_start{1.0f};
+			float f_end{50.0f};
+
+			// Prbs: 1ビットを保持するtick数
+			u8 prbs_hold{1};
+		};
+
+		struct Sample final
+		{
+			i16 command;
+			i16 angle;
+			i16 speed;
+			i16 current;
+		};
+		// 1サンプルがCANの1フレームに収まること
+		static_assert(sizeof(Sample) == 8);
+
+		static constexpr u16 capacity = 256;
+		static constexpr i16 amplitude_max = 16384;  // C620の電流指令値の上限
+
+		private:
+		const float tick_period;
+
+		Config config{};
+		std::array<Sample, capacity> samples{};
+		u16 count{0};
+		bool running{false};
+
+		float phase{0.0f};
+		u16 lfsr{1};
+		u8 hold_count{0};
+
+		public:
+		Identification(const float tick_period) noexcept:
+			tick_period(tick_period)
+		{}
+
+		void start(const Config& new_config) noexcept
+		{
+			config = new_config;
+			config.amplitude = std::max<i16>(-amplitude_max, std::min<i16>(amplitude_max, config.amplitude));
+			config.length = std::min(config.length, capacity);
+			if(config.prbs_hold == 0) config.prbs_hold = 1;
+
+			count = 0;
+			phase = 0.0f;
+			lfsr = 1;
+			hold_count = 0;
+			running = config.length != 0;
+		}
+
+		void abort() noexcept
+		{
+			running = false;
+		}
+
+		bool is_running() const noexcept
+		{
+			return running;
+		}
+
+		u8 target_motor() const noexcept
+		{
+			return config.motor;
+		}
+
+		/// @brief 制御周期ごとに呼ぶ。注入する電流指令値を返し、現在のフィードバックと一緒に記録する
+		/// @param limit 指令値を受け取り、実際に送る値を返す。記録するのはこちら
+		/// @details 記録し終えた次のtickは0を返してから止まる
+		template<class Limit>
+		i16 run_and_calc_target(const Feedback& feedback, Limit&& limit) noexcept
+		{
+			if(!running) return 0;
+
+			if(count >= config.length)
+			{
+				running = false;
+				return 0;
+			}
+
+			const i16 command = limit(config.excitation == Excitation::Chirp ? calc_chirp() : calc_prbs());
+			samples[count++] = Sample{.command=command, .angle=feedback.angle, .speed=feedback.speed, .current=feedback.current};
+			return command;
+		}
+
+		u16 size() const noexcept
+		{
+			return count;
+		}
+
+		std::optional<Sample> get_sample(const u16 index) const noexcept
+		{
+			if(index >= count) return std::nullopt;
+			return samples[index];
+		}
+
+		private:
+		i16 calc_chirp() noexcept
+		{
+			constexpr float two_pi = 2.0f * std::numbers::pi_v<float>;
+
+			const float progress = static_cast<float>(count) / config.length;
+			const float frequency = config.f_start + (config.f_end - config.f_start) * progress;
+
+			const i16 ret = config.amplitude * std::sin(phase);
+			phase += two_pi * frequency * tick_period;
+			if(phase >= two_pi) phase -= two_pi;
+			return ret;
+		}
+
+		i16 calc_prbs() noexcept
+		{
+			if(hold_count == 0)
+			{
+				// x^16 + x^14 + x^13 + x^11 + 1 (最大周期のGalois LFSR)
+				lfsr = (lfsr >> 1) ^ (-(lfsr & 1u) & 0xB400u);
+				hold_count = config.prbs_hold;
+			}
+			--hold_count;
+
+			return (lfsr & 1u) ? config.amplitude : -config.amplitude;
+		}
+	};
+}
@@ -1,8 +1,17 @@
 #pragma once
 
+#include <array>
+#include <cmath>
+#include <optional>
+
 #include <CRSLibtmp/std_type.hpp>
 #include <CRSLibtmp/Math/pid.hpp>
 #include "motor_state.hpp"
+#include "cycle_counter.hpp"
+#include "ring_buffer.hpp"
+#include "feedforward.hpp"
+#include "state_machine.hpp"
+#include "ram_func.hpp"
 
 namespace Nhk23Servo
 {
@@ -10,6 +19,59 @@ namespace Nhk23Servo
 
 	class Injector final
 	{
+		public:
+		// 射出指令。count回、interval_ms以上の間隔を空けて射出する
+		struct Shot final
+		{
+			i16 speed;
+			u8 count;
+			u16 interval_ms;
+		};
+
+		struct ShotCounter final
+		{
+			u16 queued{0};
+			u16 fired{0};
+			u16 dropped{0};
+		};
+
+		static constexpr std::size_t shot_queue_size = 4;
+
+		// 原点出しの方法
+		enum class HomingMethod : u8
+		{
+			HardStop,  // 回っていたものが止まるまで押し当てる
+			CurrentThreshold  // 電流が閾値を超えた位置
+		};
+
+		// 詰まりを検出したときの対処
+		enum class JamRecovery : u8
+		{
+			BackOff,  // 少し戻してからSettingUpをやり直す。jam_retry_max回失敗したらFault
+			Fault  // 止めて、clear_faultされるまで動かさない
+		};
+
+		struct JamCounter final
+		{
+			u16 jams{0};
+			u16 retries{0};
+			u16 faults{0};
+		};
+
+		enum class ControlState : u8
+		{
+			Idle,
+			Injecting,
+			Stopping,
+			SettingUp,
+			Homing,
+			BackingOff,
+			Fault,
+
+			N
+		};
+
+		private:
 		struct Constant final
 		{
 			float gear_ratio;
@@ -24,109 +86,450 @@ namespace Nhk23Servo
 
 			static constexpr i32 enough_slow_speed = 60;
 			static constexpr i32 setting_up_speed = 60;
-			static constexpr i32 current_max = 0x4;
+
+			// 原点は砲身の負の側の端。負の向きに探し、見つけたらSettingUpで正の向きに離れる
+			// 速さはenough_slow_speedより十分大きくし、止まったことと区別する。1周期(2 * barrel_length)を回ってもhoming_timeout_ticksに収まる
+			static constexpr i32 homing_speed = -300;
+			static constexpr i32 homing_current_threshold = 0x8'00;
+			static constexpr u16 homing_hold_ticks = 10;
+			// 原点が見つからないままこれだけ経ったらFault。2msで5秒
+			static constexpr u16 homing_timeout_ticks = 2500;
+
+			// 電流指令が上限の7/8以上なのに速度がenough_slow_speed未満の状態がjam_window_ticks続いたら詰まり
+			static constexpr u16 jam_window_ticks = 25;
+			static constexpr i32 back_off_speed = -60;
+			static constexpr u16 back_off_ticks = 50;
+			static constexpr u8 jam_retry_max = 3;
 		};
 
 		const Constant constant;
+		const HomingMethod homing_method;
+		JamRecovery jam_recovery{JamRecovery::BackOff};
+
+		// ControlStateの各状態の処理。遷移は下のControlTableにまとめる
+		i16 run_idle() noexcept;
+		i16 run_injecting() noexcept;
+		i16 run_stopping() noexcept;
+		i16 run_setting_up() noexcept;
+		i16 run_homing() noexcept;
+		i16 run_backing_off() noexcept;
+		i16 run_fault() noexcept;
+
+		void enter_idle() noexcept;
+		void enter_injecting() noexcept;
+		void enter_homing() noexcept;
+		void reset_state_ticks() noexcept;
+
+		bool is_shot_due() const noexcept;
+		bool is_barrel_passed() const noexcept;
+		bool is_slow_enough() const noexcept;
+		bool is_idling_point() const noexcept;
+		bool is_home_detected() const noexcept;
+		bool is_homing_timed_out() const noexcept;
+		bool is_backed_off() const noexcept;
+
+		void take_shot() noexcept;
+		void record_home() noexcept;
 
-		// ControlState
-		struct Idle final{};
-		struct Injecting final
+		struct ControlTable final
 		{
-			i32 injection_point;
-			i16 speed;
+			using Owner = Injector;
+			using State = ControlState;
+			using Output = i16;
+
+			static constexpr std::array<StateAction<Injector, i16>, static_cast<std::size_t>(State::N)> states
+			{{
+				{.run=&Injector::run_idle, .entry=&Injector::enter_idle},
+				{.run=&Injector::run_injecting, .entry=&Injector::enter_injecting},
+				{.run=&Injector::run_stopping},
+				{.run=&Injector::run_setting_up},
+				{.run=&Injector::run_homing, .entry=&Injector::enter_homing},
+				{.run=&Injector::run_backing_off, .entry=&Injector::reset_state_ticks},
+				{.run=&Injector::run_fault}
+			}};
+
+			static constexpr std::array<StateTransition<Injector, ControlState>, 7> transitions
+			{{
+				{.from=State::Idle, .to=State::Injecting, .guard=&Injector::is_shot_due, .action=&Injector::take_shot},
+				{.from=State::Injecting, .to=State::Stopping, .guard=&Injector::is_barrel_passed},
+				{.from=State::Stopping, .to=State::SettingUp, .guard=&Injector::is_slow_enough},
+				{.from=State::SettingUp, .to=State::Idle, .guard=&Injector::is_idling_point},
+				{.from=State::Homing, .to=State::SettingUp, .guard=&Injector::is_home_detected, .action=&Injector::record_home},
+				{.from=State::Homing, .to=State::Fault, .guard=&Injector::is_homing_timed_out},
+				{.from=State::BackingOff, .to=State::SettingUp, .guard=&Injector::is_backed_off}
+			}};
 		};
-		struct Stopping final{};
-		struct SettingUp final{};
 
-		std::variant<Idle, Injecting, Stopping, SettingUp> control_state{};
-		
+		StateMachine<ControlTable> control_state{ControlState::Idle};
+		// Injectingの射出開始位置と速度
+		i32 injection_point{0};
+		i16 injecting_speed{0};
+		// HomingとBackingOffで、入ってからの条件を満たしたtick数
+		u16 state_ticks{0};
+		// Homingに入ってからのtick数
+		u16 homing_ticks{0};
+		// Homingに入ってから、enough_slow_speed以上で回ったか
+		bool homing_moved{false};
+
 		MotorState motor_state{};
 
+		// 砲身の原点のモーター角度。fixed_positionはここからの位置
+		i32 barrel_offset{0};
+		std::optional<i32> homed_offset{};
+		// 最初のフィードバックでこの位置になるよう回転数を復元する
+		std::optional<i32> restoring_position{};
+
+		// Idleに戻り次第、先頭から射出する
+		RingBuffer<Shot, shot_queue_size> shot_queue{};
+		ShotCounter shot_counter{};
+		u32 last_shot_time{0};
+		u32 injection_start_cycle{0};
+		u32 now{0};
+		i16 current_limit{0};
+
+		// 詰まり検出
+		u16 stalled_ticks{0};
+		u8 jam_retries{0};
+		JamCounter jam_counter{};
+
 		// pid
 		CRSLib::Math::Pid<i16> speed_pid;
+		Feedforward feedforward{};
+		i16 last_target_speed{0};
 
 		public:
-		Injector(const float gear_ratio, const CRSLib::Math::Pid<i16>& speed_pid) noexcept:
+		Injector(const float gear_ratio, const CRSLib::Math::Pid<i16>& speed_pid, const HomingMethod homing_method = HomingMethod::HardStop) noexcept:
 			constant(gear_ratio),
+			homing_method(homing_method),
 			speed_pid(speed_pid)
 		{}
 
-		void update_motor_state(const Feedback& state) noexcept
+		void update_motor_state(const Feedback& state, const u32 now_ms) noexcept
 		{
-			motor_state.update(state);
+			motor_state.update(state, now_ms);
+
+			if(restoring_position)
+			{
+				const i32 total = barrel_offset + *restoring_position;
+				motor_state.motor_rotation_count = std::lround(static_cast<float>(total - state.angle) / MotorState::full_angle);
+				restoring_position.reset();
+			}
+		}
+
+		/// @brief 原点出しを始める。終わるとSettingUpを経てIdleになり、homing_timeout_ticks以内に見つからなければFaultになる
+		void start_homing() noexcept
+		{
+			control_state.transit(*this, ControlState::Homing);
+		}
+
+		/// @brief 原点出しをせず、保存しておいた原点と砲身の位置を使う。リセットしても電源が落ちていないとき用
+		void restore(const i32 barrel_offset, const i32 fixed_position) noexcept
+		{
+			this->barrel_offset = barrel_offset;
+			restoring_position = fixed_position;
+		}
+
+		void set_jam_recovery(const JamRecovery jam_recovery) noexcept
+		{
+			this->jam_recovery = jam_recovery;
 		}
 
-		void inject_start(const i16 speed) noexcept
+		/// @brief Faultから復帰し、SettingUpからやり直す
+		void clear_fault() noexcept
 		{
-			// Idleでなければ何もしない
-			if(std::holds_alternative<Idle>(control_state))
+			if(control_state.is(ControlState::Fault))
 			{
-				control_state.template emplace<Injecting>(motor_state.get_total_angle(), speed);
+				jam_retries = 0;
+				control_state.transit(*this, ControlState::SettingUp);
 			}
 		}
 
-		private:
-		struct UpdateCurrent final
+		void set_feedforward(const Feedforward& feedforward) noexcept
 		{
-			Injector& injector;
+			this->feedforward = feedforward;
+		}
 
-			UpdateCurrent(Injector& injector) noexcept:
-				injector(injector)
-			{}
+		const Feedforward& get_feedforward() const noexcept
+		{
+			return feedforward;
+		}
+
+		const JamCounter& get_jam_counter() const noexcept
+		{
+			return jam_counter;
+		}
+
+		ControlState get_control_state() const noexcept
+		{
+			return control_state.get();
+		}
+
+		const StateStats& get_state_stats(const ControlState state) const noexcept
+		{
+			return control_state.get_stats(state);
+		}
 
-			i16 operator()(Idle) noexcept
+		/// @brief 原点出しで見つけた原点。取り出すと次の原点出しまでnullopt
+		std::optional<i32> take_homed_offset() noexcept
+		{
+			const auto ret = homed_offset;
+			homed_offset.reset();
+			return ret;
+		}
+
+		i32 get_barrel_offset() const noexcept
+		{
+			return barrel_offset;
+		}
+
+		/// @brief 1発射出する。Idleでなければキューに積む
+		bool inject_start(const i16 speed) noexcept
+		{
+			return inject_burst(speed, 1, 0);
+		}
+
+		/// @brief count発を、前の射出からinterval_ms以上空けて射出する。キューが一杯なら捨てる
+		bool inject_burst(const i16 speed, const u8 count, const u16 interval_ms) noexcept
+		{
+			if(count == 0) return false;
+
+			if(!shot_queue.push(Shot{.speed=speed, .count=count, .interval_ms=interval_ms}))
 			{
-				return injector.calc_target_current_from_speed(0.0);
+				shot_counter.dropped += count;
+				return false;
 			}
+			shot_counter.queued += count;
+			return true;
+		}
 
-			i16 operator()(const Injecting& injecting) noexcept
+		/// @brief キューに残っている射出を捨てる
+		void clear_shots() noexcept
+		{
+			for(auto shot = shot_queue.pop(); shot; shot = shot_queue.pop())
 			{
-				if(std::abs(injector.motor_state.get_total_angle() - injecting.injection_point) > injector.constant.barrel_length)
-				{
-					injector.control_state.template emplace<Stopping>();
-					return injector.calc_target_current_from_speed(0.0);
-				}
-				return injector.calc_target_current_from_speed(injecting.speed);
+				shot_counter.dropped += shot->count;
 			}
+		}
 
-			i16 operator()(Stopping) noexcept
+		/// @brief キューを捨て、射出中ならStoppingへ移る。指令が途絶えたとき用
+		void stop() noexcept
+		{
+			clear_shots();
+			if(control_state.is(ControlState::Injecting)) control_state.transit(*this, ControlState::Stopping);
+		}
+
+		const ShotCounter& get_shot_counter() const noexcept
+		{
+			return shot_counter;
+		}
+
+		/// @brief Idleで、キューも空
+		bool is_ready() const noexcept
+		{
+			return control_state.is(ControlState::Idle) && shot_queue.empty();
+		}
+
+		/// @brief キューを通さず、この制御tickで射出を始める。同時射出用
+		/// @details 発数の勘定はキューを通したものと同じく、queuedにも数える
+		bool fire_now(const i16 speed, const u32 now) noexcept
+		{
+			if(!control_state.is(ControlState::Idle)) return false;
+
+			++shot_counter.queued;
+			this->now = now;
+			injecting_speed = speed;
+			control_state.transit(*this, ControlState::Injecting);
+			return true;
+		}
+
+		/// @brief 最後にInjectingへ遷移したときのサイクルカウンタの値
+		u32 get_injection_start_cycle() const noexcept
+		{
+			return injection_start_cycle;
+		}
+
+		public:
+		/// @param now HAL_GetTick()の値
+		/// @param current_limit 電流の上限(非負)。ThermalLimiterで決める
+		NHK23_SERVO_RAM_FUNC i16 run_and_calc_target(const u32 now, const i16 current_limit) noexcept
+		{
+			this->now = now;
+			this->current_limit = current_limit;
+
+			const i16 target = control_state.step(*this);
+			if(control_state.is(ControlState::Injecting) || control_state.is(ControlState::SettingUp))
 			{
-				if(std::abs(injector.motor_state.feedback.speed) < injector.constant.enough_slow_speed)
-				{
-					injector.control_state.template emplace<SettingUp>();
-					return injector.calc_target_current_from_speed(injector.constant.setting_up_speed);
-				}
-				return injector.calc_target_current_from_speed(0.0);
+				if(detect_jam(target)) return on_jam();
 			}
-
-			i16 operator()(SettingUp) noexcept
+			else
 			{
-				if(std::abs(injector.fixed_position() - injector.constant.barrel_length) < injector.constant.idling_point_epsilon)
-				{
-					injector.control_state.template emplace<Idle>();
-					return injector.calc_target_current_from_speed(0.0);
-				}
-				return injector.calc_target_current_from_speed(injector.constant.setting_up_speed);
+				stalled_ticks = 0;
 			}
-		};
+			return target;
+		}
 
-		public:
-		i16 run_and_calc_target() noexcept
+		/// @brief 原点からの砲身の位置。[0, 2 * barrel_length)
+		i32 fixed_position() const noexcept
 		{
-			return std::visit(UpdateCurrent(*this), control_state);
+			const i32 period = 2 * constant.barrel_length;
+			const i32 position = (motor_state.get_total_angle() - barrel_offset) % period;
+			return position < 0 ? position + period : position;
 		}
 
 		private:
-		i16 calc_target_current_from_speed(i16 target) noexcept
+		/// @brief 電流を上限近くまで流しているのに回らない時間を数える
+		bool detect_jam(const i16 target) noexcept
 		{
-			const auto ret = speed_pid.update(target, motor_state.feedback.speed);
-			return std::max<i16>(-constant.current_max, std::min<i16>(constant.current_max, ret));
+			const bool saturated = current_limit > 0 && std::abs(target) >= current_limit - current_limit / 8;
+			const bool stalled = std::abs(motor_state.feedback.speed) < constant.enough_slow_speed;
+
+			stalled_ticks = saturated && stalled ? stalled_ticks + 1 : 0;
+			return stalled_ticks >= constant.jam_window_ticks;
 		}
 
-		i32 fixed_position() const noexcept
+		i16 on_jam() noexcept
 		{
-			return motor_state.get_total_angle() % (2 * constant.barrel_length);
+			stalled_ticks = 0;
+			++jam_counter.jams;
+
+			if(jam_recovery == JamRecovery::BackOff && jam_retries < constant.jam_retry_max)
+			{
+				++jam_retries;
+				++jam_counter.retries;
+				control_state.transit(*this, ControlState::BackingOff);
+				return calc_target_current_from_speed(constant.back_off_speed);
+			}
+
+			++jam_counter.faults;
+			control_state.transit(*this, ControlState::Fault);
+			return 0;
+		}
+
+		i16 calc_target_current_from_speed(i16 target) noexcept
+		{
+			const i16 acceleration = target - last_target_speed;
+			last_target_speed = target;
+
+			const float ret = speed_pid.update(target, motor_state.feedback.speed) + feedforward.calc(target, acceleration);
+			return std::max<float>(-current_limit, std::min<float>(current_limit, ret));
 		}
 	};
+
+	inline i16 Injector::run_idle() noexcept
+	{
+		return calc_target_current_from_speed(0);
+	}
+
+	inline i16 Injector::run_injecting() noexcept
+	{
+		return calc_target_current_from_speed(injecting_speed);
+	}
+
+	inline i16 Injector::run_stopping() noexcept
+	{
+		return calc_target_current_from_speed(0);
+	}
+
+	inline i16 Injector::run_setting_up() noexcept
+	{
+		return calc_target_current_from_speed(constant.setting_up_speed);
+	}
+
+	inline i16 Injector::run_homing() noexcept
+	{
+		const auto& feedback = motor_state.feedback;
+		const bool over_current = std::abs(feedback.current) >= constant.homing_current_threshold;
+		const bool stalled = std::abs(feedback.speed) < constant.enough_slow_speed;
+		// 回り出す前も止まっているので、一度回ってから止まったものだけを押し当てたとみなす
+		homing_moved = homing_moved || !stalled;
+		const bool detected = homing_method == HomingMethod::HardStop ? homing_moved && stalled : over_current;
+
+		state_ticks = detected ? state_ticks + 1 : 0;
+		++homing_ticks;
+		return calc_target_current_from_speed(constant.homing_speed);
+	}
+
+	inline i16 Injector::run_backing_off() noexcept
+	{
+		++state_ticks;
+		return calc_target_current_from_speed(constant.back_off_speed);
+	}
+
+	inline i16 Injector::run_fault() noexcept
+	{
+		return 0;
+	}
+
+	inline void Injector::enter_idle() noexcept
+	{
+		jam_retries = 0;
+	}
+
+	inline void Injector::enter_injecting() noexcept
+	{
+		++shot_counter.fired;
+		last_shot_time = now;
+		injection_start_cycle = CycleCounter::now();
+		injection_point = motor_state.get_total_angle();
+	}
+
+	inline void Injector::enter_homing() noexcept
+	{
+		state_ticks = 0;
+		homing_ticks = 0;
+		homing_moved = false;
+	}
+
+	inline void Injector::reset_state_ticks() noexcept
+	{
+		state_ticks = 0;
+	}
+
+	inline bool Injector::is_shot_due() const noexcept
+	{
+		return !shot_queue.empty() && now - last_shot_time >= shot_queue.front().interval_ms;
+	}
+
+	inline bool Injector::is_barrel_passed() const noexcept
+	{
+		return std::abs(motor_state.get_total_angle() - injection_point) > constant.barrel_length;
+	}
+
+	inline bool Injector::is_slow_enough() const noexcept
+	{
+		return std::abs(motor_state.feedback.speed) < constant.enough_slow_speed;
+	}
+
+	inline bool Injector::is_idling_point() const noexcept
+	{
+		return std::abs(fixed_position() - constant.barrel_length) < constant.idling_point_epsilon;
+	}
+
+	inline bool Injector::is_home_detected() const noexcept
+	{
+		return state_ticks >= constant.homing_hold_ticks;
+	}
+
+	inline bool Injector::is_homing_timed_out() const noexcept
+	{
+		return homing_ticks >= constant.homing_timeout_ticks;
+	}
+
+	inline bool Injector::is_backed_off() const noexcept
+	{
+		return state_ticks >= constant.back_off_ticks;
+	}
+
+	inline void Injector::take_shot() noexcept
+	{
+		injecting_speed = shot_queue.front().speed;
+		if(--shot_queue.front().count == 0) (void)shot_queue.pop();
+	}
+
+	inline void Injector::record_home() noexcept
+	{
+		barrel_offset = 0;
+		barrel_offset = fixed_position();
+		homed_offset = barrel_offset;
+	}
 }
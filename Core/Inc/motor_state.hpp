@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <algorithm>
 
 #include <CRSLibtmp/std_type.hpp>
 #include "feedback.hpp"
@@ -13,22 +14,43 @@ namespace Nhk23Servo
 	struct MotorState
 	{
 		static constexpr i32 full_angle = 8192;
+		// C620がフィードバックを送る周期[ms]
+		static constexpr u32 feedback_period_ms = 1;
 		Feedback feedback{};
 		i32 motor_rotation_count{0};
+		bool received{false};
+		u32 received_ms{0};
 
-		void update(const Feedback& new_feedback) noexcept
+		/// @brief 角度の変化から回転数を数える
+		/// @details 角度の差だけでは、フレームが落ちて半回転以上進んだときに向きを取り違える。
+		/// 前後の速度[rpm]から進んだ角度を見積もり、それに最も近くなるよう回転数を決める
+		/// @param now_ms 受信した時刻。FIFOに溜まっていたフレームは同じ時刻になるので、間隔はfeedback_period_ms以上とみなす
+		void update(const Feedback& new_feedback, const u32 now_ms) noexcept
 		{
-			if(std::abs(new_feedback.angle - feedback.angle) > full_angle / 2)
+			// 最初のフレームは比較対象がないので回転数を数えない
+			if(received)
 			{
-				motor_rotation_count += std::signbit(new_feedback.angle - feedback.angle) ? -1 : 1;
+				const i32 delta = new_feedback.angle - feedback.angle;
+				const u32 elapsed_ms = std::max(now_ms - received_ms, feedback_period_ms);
+				const i64 predicted = static_cast<i64>(feedback.speed + new_feedback.speed) * full_angle * elapsed_ms / (2 * 60'000);
+				motor_rotation_count += round_div(predicted - delta, full_angle);
 			}
 
 			feedback = new_feedback;
+			received = true;
+			received_ms = now_ms;
 		}
 
 		i32 get_total_angle() const noexcept
 		{
 			return motor_rotation_count * full_angle + feedback.angle;
 		}
+
+		private:
+		/// @brief 四捨五入する割り算。浮動小数点を使わない
+		static constexpr i32 round_div(const i64 numerator, const i32 denominator) noexcept
+		{
+			return static_cast<i32>((numerator + (numerator < 0 ? -denominator / 2 : denominator / 2)) / denominator);
+		}
 	};
 }
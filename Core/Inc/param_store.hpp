@@ -0,0 +1,200 @@
+#pragma once
+
+#include <array>
+#include <optional>
+
+#include "main.h"
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief フラッシュの最後の2ページを使ったEEPROMエミュレーション。パラメータ(キーと32bitの値)を保存する
+	/// @details 書き込みは今のページの末尾にレコードを追記するだけで、ページが一杯になったら最新の値だけをもう一方のページへ移す。
+	/// 2ページを交互に消去するので、消去回数は両方に分散する。各レコードはCRCで検証し、起動時に全レコードを読んでRAMに値を持つ
+	/// @tparam KeyN キーの数。キーは[0, KeyN)
+	/// @attention 2ページはリンカスクリプトでプログラム領域から外してある。消去と書き込みの間はフラッシュからの命令フェッチが止まる
+	template<u16 KeyN>
+	class ParamStore final
+	{
+		static_assert(KeyN < 0xFF'FF);
+
+		public:
+		static constexpr u32 page_size = 0x400;
+		static constexpr std::array<u32, 2> pages{0x0800'F800, 0x0800'FC00};
+
+		private:
+		static constexpr u32 magic = 0x4E'48'4B'50;  // "NHKP"
+
+		// ページの先頭。magicを最後に書くので、magicが正しければ移し終えている
+		struct Header final
+		{
+			u32 generation;
+			u32 magic;
+		};
+
+		struct Record final
+		{
+			u32 value;
+			u16 crc;
+			u16 key;  // 最後に書く
+		};
+		static_assert(sizeof(Header) == 8 && sizeof(Record) == 8);
+
+		static constexpr u32 record_n = (page_size - sizeof(Header)) / sizeof(Record);
+
+		std::array<u32, KeyN> values{};
+		std::array<bool, KeyN> present{};
+		u8 active{0};
+		u32 generation{0};
+		u32 used{0};  // 今のページの使ったレコード数
+		bool valid{false};
+
+		public:
+		/// @brief 起動時に1回呼ぶ。有効なページがなければ初期化する
+		bool load() noexcept
+		{
+			std::optional<u8> newest{};
+			for(u8 i = 0; i < pages.size(); ++i)
+			{
+				const auto& header = get_header(i);
+				if(header.magic != magic) continue;
+				if(!newest || header.generation > get_header(*newest).generation) newest = i;
+			}
+
+			if(!newest)
+			{
+				valid = format(0, 0);
+				return valid;
+			}
+
+			active = *newest;
+			generation = get_header(active).generation;
+			used = 0;
+			present = {};
+			for(; used < record_n; ++used)
+			{
+				const auto& record = get_record(active, used);
+				if(is_erased(record)) break;
+
+				// 書きかけのレコードは読み飛ばす
+				if(record.key < KeyN && record.crc == calc_crc(record.key, record.value))
+				{
+					values[record.key] = record.value;
+					present[record.key] = true;
+				}
+			}
+
+			valid = true;
+			return valid;
+		}
+
+		std::optional<u32> get(const u16 key) const noexcept
+		{
+			if(key >= KeyN || !present[key]) return std::nullopt;
+			return values[key];
+		}
+
+		/// @brief 値が変わっていれば追記する。ページが一杯ならもう一方のページへ移してから書く
+		bool set(const u16 key, const u32 value) noexcept
+		{
+			if(!valid || key >= KeyN) return false;
+			if(present[key] && values[key] == value) return true;
+
+			values[key] = value;
+			present[key] = true;
+
+			if(used >= record_n) return format(1 - active, generation + 1);
+
+			HAL_FLASH_Unlock();
+			const bool ok = program(active, used, key, value);
+			HAL_FLASH_Lock();
+			++used;
+			return ok;
+		}
+
+		/// @brief 使ったレコード数。record_nに達すると次の書き込みでページを移す
+		u32 size() const noexcept
+		{
+			return used;
+		}
+
+		u32 get_generation() const noexcept
+		{
+			return generation;
+		}
+
+		private:
+		static const Header& get_header(const u8 page) noexcept
+		{
+			return *reinterpret_cast<const Header *>(pages[page]);
+		}
+
+		static const Record& get_record(const u8 page, const u32 index) noexcept
+		{
+			return *reinterpret_cast<const Record *>(pages[page] + sizeof(Header) + sizeof(Record) * index);
+		}
+
+		static bool is_erased(const Record& record) noexcept
+		{
+			return record.value == 0xFFFF'FFFF && record.crc == 0xFF'FF && record.key == 0xFF'FF;
+		}
+
+		/// @brief pageを消去して今の値を全部書き、最後にヘッダを書く。途中で電源が落ちても元のページが残る
+		bool format(const u8 page, const u32 new_generation) noexcept
+		{
+			HAL_FLASH_Unlock();
+
+			FLASH_EraseInitTypeDef erase{};
+			erase.TypeErase = FLASH_TYPEERASE_PAGES;
+			erase.PageAddress = pages[page];
+			erase.NbPages = 1;
+			u32 page_error = 0;
+			bool ok = HAL_FLASHEx_Erase(&erase, &page_error) == HAL_OK;
+
+			u32 index = 0;
+			for(u16 key = 0; ok && key < KeyN; ++key)
+			{
+				if(present[key]) ok = program(page, index++, key, values[key]);
+			}
+
+			const u32 header_address = pages[page];
+			ok = ok && HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, header_address, new_generation) == HAL_OK;
+			ok = ok && HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, header_address + sizeof(u32), magic) == HAL_OK;
+
+			HAL_FLASH_Lock();
+
+			if(ok)
+			{
+				active = page;
+				generation = new_generation;
+				used = index;
+			}
+			return ok;
+		}
+
+		static bool program(const u8 page, const u32 index, const u16 key, const u32 value) noexcept
+		{
+			const u32 address = pages[page] + sizeof(Header) + sizeof(Record) * index;
+			return HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, value) == HAL_OK
+				&& HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 4, calc_crc(key, value)) == HAL_OK
+				&& HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 6, key) == HAL_OK;
+		}
+
+		/// @brief CRC-16/CCITT-FALSE。キー(2byte)と値(4byte)をリトルエンディアンで
+		static constexpr u16 calc_crc(const u16 key, const u32 value) noexcept
+		{
+			const std::array<u8, 6> bytes{(u8)key, (u8)(key >> 8), (u8)value, (u8)(value >> 8), (u8)(value >> 16), (u8)(value >> 24)};
+
+			u16 crc = 0xFF'FF;
+			for(const u8 octet : bytes)
+			{
+				crc ^= static_cast<u16>(octet) << 8;
+				for(u8 i = 0; i < 8; ++i) crc = crc & 0x80'00 ? (crc << 1) ^ 0x10'21 : crc << 1;
+			}
+			return crc;
+		}
+	};
+}
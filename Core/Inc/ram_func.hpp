@@ -0,0 +1,12 @@
+#pragma once
+
+// 制御周期ごとやCANの受信ごとに呼ばれる関数をRAMに置き、フラッシュのウェイト(72MHzではFLASH_LATENCY_2)を避ける。
+// .RamFuncはリンカスクリプトで.dataに入っているので、起動時に.dataと一緒にRAMへコピーされる。
+// RAMとフラッシュの間の呼び出しはリンカが挿入するveneerを通る。
+// NHK23_SERVO_RAM_FUNC_IN_FLASHを定義するとフラッシュに戻る。Diagnostic::Cyclesで両者を比べる用
+#ifdef NHK23_SERVO_RAM_FUNC_IN_FLASH
+#define NHK23_SERVO_RAM_FUNC
+#else
+// インライン展開されると呼び出し元(フラッシュ)に入ってしまうので止める
+#define NHK23_SERVO_RAM_FUNC __attribute__((section(".RamFunc"), noinline))
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <optional>
+
+namespace Nhk23Servo
+{
+	/// @brief 固定長のリングバッファ。動的確保はしない
+	template<class T, std::size_t N>
+	class RingBuffer final
+	{
+		static_assert(N > 0);
+
+		std::array<T, N> buffer{};
+		std::size_t head{0};
+		std::size_t count{0};
+
+		public:
+		static constexpr std::size_t capacity = N;
+
+		bool push(const T& value) noexcept
+		{
+			if(full()) return false;
+
+			buffer[(head + count) % N] = value;
+			++count;
+			return true;
+		}
+
+		/// @brief 満杯なら最も古い要素を捨てて追加する
+		void push_overwrite(const T& value) noexcept
+		{
+			if(full()) (void)pop();
+			(void)push(value);
+		}
+
+		std::optional<T> pop() noexcept
+		{
+			if(empty()) return std::nullopt;
+
+			const T ret = buffer[head];
+			head = (head + 1) % N;
+			--count;
+			return ret;
+		}
+
+		T& front() noexcept
+		{
+			return buffer[head];
+		}
+
+		const T& front() const noexcept
+		{
+			return buffer[head];
+		}
+
+		/// @brief 古い方から数えてindex番目の要素
+		const T& operator[](const std::size_t index) const noexcept
+		{
+			return buffer[(head + index) % N];
+		}
+
+		void clear() noexcept
+		{
+			head = 0;
+			count = 0;
+		}
+
+		std::size_t size() const noexcept
+		{
+			return count;
+		}
+
+		bool empty() const noexcept
+		{
+			return count == 0;
+		}
+
+		bool full() const noexcept
+		{
+			return count == N;
+		}
+	};
+}
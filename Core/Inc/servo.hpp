@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "tim.h"
+
+#include <CRSLibtmp/std_type.hpp>
+#include "servo_timebase.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief サーボのパルス幅[us]の較正値
+	struct ServoCalibration final
+	{
+		// 右端、正面、左端。機構の可動範囲もこの間
+		float pulse_min_us{785.0f};
+		float pulse_center_us{1410.0f};
+		float pulse_max_us{2215.0f};
+		float us_per_degree{10.0f};
+	};
+
+	/// @brief 角速度を制限しながら目標角度へサーボを動かす。PWMの1周期ごとにupdateを呼ぶこと
+	class Servo final
+	{
+		public:
+		struct Constant final
+		{
+			// サーボ自体の最高角速度[deg/s]。これより速い指令は意味がない
+			static constexpr u16 servo_max_speed = 400;
+		};
+
+		private:
+		TIM_HandleTypeDef& htim;
+		const u32 channel;
+		const ServoCalibration calibration;
+
+		// 以下パルス幅[us]
+		float position;
+		float target;
+		float step{0.0f};  // 1周期あたりに動かすパルス幅。0なら即座に目標へ
+		u16 max_speed{0};
+		bool active{false};
+
+		public:
+		Servo(TIM_HandleTypeDef& htim, const u32 channel, const ServoCalibration& calibration = {}) noexcept:
+			htim(htim),
+			channel(channel),
+			calibration(calibration),
+			position(calibration.pulse_center_us),
+			target(calibration.pulse_center_us)
+		{}
+
+		const ServoCalibration& get_calibration() const noexcept
+		{
+			return calibration;
+		}
+
+		/// @param angle 正面からの角度[0.1deg]。左が正
+		/// @param max_speed 最大角速度[deg/s]。0なら制限しない
+		void set_target(const i16 angle, const u16 max_speed) noexcept
+		{
+			set_target_pulse(calibration.pulse_center_us + angle * calibration.us_per_degree / 10, max_speed);
+		}
+
+		/// @param pulse_us パルス幅[us]。較正値の範囲に制限される
+		void set_target_pulse(const float pulse_us, const u16 max_speed) noexcept
+		{
+			target = std::max(calibration.pulse_min_us, std::min(calibration.pulse_max_us, pulse_us));
+
+			this->max_speed = max_speed;
+			step = max_speed == 0 ? 0.0f : max_speed * calibration.us_per_degree * ServoTimebase::frame_ms / 1000;
+
+			// 初回は現在位置が分からないのでそのまま目標へ
+			if(!active)
+			{
+				position = target;
+				active = true;
+				write();
+			}
+		}
+
+		/// @brief PWMの更新イベントごとに呼ぶ。比較値はプリロードされ、次の周期から反映される
+		void update() noexcept
+		{
+			if(!active || position == target) return;
+
+			if(step == 0.0f || std::abs(target - position) <= step)
+			{
+				position = target;
+			}
+			else
+			{
+				position += target > position ? step : -step;
+			}
+			write();
+		}
+
+		/// @brief 目標角度に落ち着くまでの推定時間[ms]
+		u32 estimate_settle_ms() const noexcept
+		{
+			const u16 speed = max_speed == 0 ? Constant::servo_max_speed : std::min(max_speed, Constant::servo_max_speed);
+			const float degree = std::abs(target - position) / calibration.us_per_degree;
+			return std::ceil(degree * 1000 / speed) + ServoTimebase::frame_ms;
+		}
+
+		u16 get_max_speed() const noexcept
+		{
+			return max_speed;
+		}
+
+		bool is_settled() const noexcept
+		{
+			return position == target;
+		}
+
+		private:
+		void write() noexcept
+		{
+			__HAL_TIM_SET_COMPARE(&htim, channel, ServoTimebase::us_to_ticks(position));
+		}
+	};
+}
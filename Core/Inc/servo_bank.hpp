@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+
+#include "tim.h"
+
+#include <CRSLibtmp/std_type.hpp>
+#include "servo.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief TIM1のCH1~CH4に繋がったサーボをまとめて扱う
+	/// @attention 比較値はプリロードレジスタに書かれ、全チャンネル分が同じ更新イベントで反映される
+	class ServoBank final
+	{
+		public:
+		static constexpr u8 size = 4;
+
+		private:
+		TIM_HandleTypeDef& htim;
+		std::array<Servo, size> servos;
+
+		public:
+		ServoBank(TIM_HandleTypeDef& htim) noexcept:
+			htim(htim),
+			servos{Servo{htim, TIM_CHANNEL_1}, Servo{htim, TIM_CHANNEL_2}, Servo{htim, TIM_CHANNEL_3}, Servo{htim, TIM_CHANNEL_4}}
+		{}
+
+		void start() noexcept
+		{
+			ServoTimebase::apply(htim);
+			for(const u32 channel : {TIM_CHANNEL_1, TIM_CHANNEL_2, TIM_CHANNEL_3, TIM_CHANNEL_4})
+			{
+				HAL_TIM_PWM_Start(&htim, channel);
+			}
+		}
+
+		Servo& operator[](const u8 index) noexcept
+		{
+			return servos[index];
+		}
+
+		/// @brief PWMの更新イベントごとに呼ぶ
+		void update() noexcept
+		{
+			// 書き込みの途中で更新イベントが起きて一部のチャンネルだけ反映されないよう、書き終えるまで更新イベントを止める
+			htim.Instance->CR1 = htim.Instance->CR1 | TIM_CR1_UDIS;
+			for(auto& servo : servos) servo.update();
+			htim.Instance->CR1 = htim.Instance->CR1 & ~TIM_CR1_UDIS;
+		}
+
+		/// @brief 全チャンネルの推定整定時間のうち最大のもの[ms]
+		u32 estimate_settle_ms() const noexcept
+		{
+			u32 ret = 0;
+			for(const auto& servo : servos) ret = std::max(ret, servo.estimate_settle_ms());
+			return ret;
+		}
+	};
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "tim.h"
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief サーボ用PWMのタイムベース。フレームレートがちょうどになる中で最も細かい分解能の分周比と周期を求める
+	struct ServoTimebase final
+	{
+		// TIM1はAPB2のタイマクロック(72MHz)で動く
+		static constexpr u32 timer_clock = 72'000'000;
+		static constexpr u32 frame_rate = 50;
+
+		static constexpr u32 divider = []() constexpr -> u32
+		{
+			for(u32 divider = 1; divider <= 0x1'00'00; ++divider)
+			{
+				const u32 counts = divider * frame_rate;
+				if(timer_clock % counts == 0 && timer_clock / counts <= 0x1'00'00) return divider;
+			}
+			return 0;
+		}();
+		static_assert(divider != 0, "No prescaler gives the exact frame rate.");
+
+		static constexpr u32 prescaler = divider - 1;
+		static constexpr u32 period = timer_clock / (divider * frame_rate) - 1;
+
+		static constexpr u32 frame_us = 1'000'000 / frame_rate;
+		static constexpr u32 frame_ms = 1'000 / frame_rate;
+		static constexpr float ticks_per_us = static_cast<float>(timer_clock) / divider / 1'000'000;
+
+		/// @brief CubeMXの設定によらず、ここで求めた値をタイマに反映する
+		static void apply(TIM_HandleTypeDef& htim) noexcept
+		{
+			__HAL_TIM_SET_PRESCALER(&htim, prescaler);
+			__HAL_TIM_SET_AUTORELOAD(&htim, period);
+			// プリスケーラはプリロードされるので、更新イベントを起こして即座に反映する
+			htim.Instance->EGR = TIM_EGR_UG;
+		}
+
+		static constexpr u32 us_to_ticks(const float us) noexcept
+		{
+			return static_cast<u32>(us * ticks_per_us + 0.5f);
+		}
+	};
+}
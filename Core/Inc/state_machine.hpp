@@ -0,0 +1,192 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#include <CRSLibtmp/std_type.hpp>
+#include "cycle_counter.hpp"
+#include "ram_func.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief 状態ごとの処理。runは状態にいる間毎回呼ばれ、出力を返す。entry/exitはnullptrなら何もしない
+	template<class Owner, class Output>
+	struct StateAction final
+	{
+		Output (Owner::*run)() noexcept;
+		void (Owner::*entry)() noexcept{nullptr};
+		void (Owner::*exit)() noexcept{nullptr};
+	};
+
+	/// @brief fromにいてguardが真ならtoへ遷移する。actionはfromのexitとtoのentryの間に呼ばれる
+	template<class Owner, class State>
+	struct StateTransition final
+	{
+		State from;
+		State to;
+		bool (Owner::*guard)() const noexcept;
+		void (Owner::*action)() noexcept{nullptr};
+	};
+
+	struct StateStats final
+	{
+		u16 entries{0};
+		u32 ticks{0};
+		u32 max_cycles{0};  // 1回のstepにかかった最大サイクル数。遷移も含む
+	};
+
+	/// @brief 状態遷移表で定義する状態機械。表はconstexprで、状態ごとの分岐(GCCはswitchにする)から各関数を直接呼ぶ
+	/// @tparam Table 次を持つ型
+	/// - Owner: 処理を持つクラス
+	/// - State: 0からの連番で、最後がNのenum class
+	/// - Output: runの戻り値
+	/// - states: Stateの順に並べたstd::array<StateAction<Owner, Output>, State::N>
+	/// - transitions: fromの昇順に並べたstd::array<StateTransition<Owner, State>, M>。同じfromの中では先にあるものが優先
+	template<class Table>
+	class StateMachine final
+	{
+		using Owner = typename Table::Owner;
+		using State = typename Table::State;
+		using Output = typename Table::Output;
+
+		static constexpr std::size_t state_n = static_cast<std::size_t>(State::N);
+
+		static constexpr auto& states = Table::states;
+		static constexpr auto& transitions = Table::transitions;
+		static_assert(states.size() == state_n);
+
+		// 各状態から出る遷移は、transitionsの[first_transition[s], first_transition[s + 1])にある
+		static constexpr std::array<u8, state_n + 1> first_transition = []() constexpr
+		{
+			std::array<u8, state_n + 1> ret{};
+			std::size_t i = 0;
+			for(std::size_t state = 0; state < state_n; ++state)
+			{
+				ret[state] = i;
+				while(i < transitions.size() && static_cast<std::size_t>(transitions[i].from) == state) ++i;
+			}
+			ret[state_n] = i;
+			return ret;
+		}();
+		static_assert(first_transition[state_n] == transitions.size(), "transitions must be sorted by from.");
+
+		template<std::size_t S>
+		using StateIndex = std::integral_constant<std::size_t, S>;
+
+		State current;
+		std::array<StateStats, state_n> stats{};
+
+		// 以下で渡すメンバ関数ポインタは全て表の定数なので、インライン展開されると直接の呼び出しになる
+
+		/// @brief fがnullptrなら何もしない。GCCはメンバ関数ポインタとnullptrの比較を定数式にできないので、if constexprではなくここで比べる
+		[[gnu::always_inline]] static void call(Owner& owner, void (Owner::*const f)() noexcept) noexcept
+		{
+			if(f) (owner.*f)();
+		}
+
+		/// @brief stateの番号をStateIndexにしてfを呼ぶ。状態ごとの比較に展開されるので、関数の表は引かない
+		template<class F>
+		static void visit(const State state, F&& f) noexcept
+		{
+			[&]<std::size_t ... S>(std::index_sequence<S ...>) noexcept
+			{
+				(void)((static_cast<std::size_t>(state) == S && (f(StateIndex<S>{}), true)) || ...);
+			}(std::make_index_sequence<state_n>{});
+		}
+
+		template<std::size_t S>
+		void enter(Owner& owner) noexcept
+		{
+			current = static_cast<State>(S);
+			++stats[S].entries;
+			call(owner, states[S].entry);
+		}
+
+		/// @brief transitionsの[I, End)のガードを順に調べ、最初に真になったものへ遷移する
+		template<std::size_t From, std::size_t I, std::size_t End>
+		void check_transitions(Owner& owner) noexcept
+		{
+			if constexpr(I < End)
+			{
+				constexpr auto& transition = transitions[I];
+				if((owner.*transition.guard)())
+				{
+					call(owner, states[From].exit);
+					call(owner, transition.action);
+					enter<static_cast<std::size_t>(transition.to)>(owner);
+				}
+				else
+				{
+					check_transitions<From, I + 1, End>(owner);
+				}
+			}
+		}
+
+		public:
+		/// @brief 初期状態のentryは呼ばない
+		constexpr StateMachine(const State initial) noexcept:
+			current(initial)
+		{}
+
+		State get() const noexcept
+		{
+			return current;
+		}
+
+		bool is(const State state) const noexcept
+		{
+			return current == state;
+		}
+
+		/// @brief ガードを調べて遷移してから、今の状態のrunを呼ぶ
+		NHK23_SERVO_RAM_FUNC Output step(Owner& owner) noexcept
+		{
+			const u32 start = CycleCounter::now();
+
+			visit(current, [&]<std::size_t S>(StateIndex<S>) noexcept
+			{
+				check_transitions<S, first_transition[S], first_transition[S + 1]>(owner);
+			});
+
+			Output ret{};
+			visit(current, [&]<std::size_t S>(StateIndex<S>) noexcept
+			{
+				ret = (owner.*states[S].run)();
+			});
+
+			auto& stat = stats[static_cast<std::size_t>(current)];
+			++stat.ticks;
+			const u32 cycles = CycleCounter::now() - start;
+			if(cycles > stat.max_cycles) stat.max_cycles = cycles;
+			return ret;
+		}
+
+		/// @brief 表によらず遷移する。今と同じ状態でもexitとentryを呼ぶ
+		void transit(Owner& owner, const State to, void (Owner::*action)() noexcept = nullptr) noexcept
+		{
+			visit(current, [&]<std::size_t S>(StateIndex<S>) noexcept
+			{
+				call(owner, states[S].exit);
+			});
+			call(owner, action);
+			visit(to, [&]<std::size_t S>(StateIndex<S>) noexcept
+			{
+				enter<S>(owner);
+			});
+		}
+
+		const StateStats& get_stats(const State state) const noexcept
+		{
+			return stats[static_cast<std::size_t>(state)];
+		}
+
+		void reset_stats() noexcept
+		{
+			stats = {};
+		}
+	};
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+
+#include <CRSLibtmp/std_type.hpp>
+#include "feedback.hpp"
+
+namespace Nhk23Servo
+{
+	using namespace CRSLib::IntegerTypes;
+
+	/// @brief I^2tの見積もりとC620が返す温度から、モーターごとの電流の上限を決める
+	/// @details 冷えていれば短時間はpeakまで流せ、熱が溜まるにつれcontinuousまで滑らかに下げる。さらに温度で0まで下げる
+	class ThermalLimiter final
+	{
+		public:
+		struct Config final
+		{
+			// 電流はC620の指令値の単位(16384で20A)
+			float continuous{0x10'00};
+			float peak{0x3C'00};
+			// continuousを超えた分のI^2tをどれだけ溜められるか。peakで約0.5秒
+			float heat_capacity{1.1e8f};
+
+			// 温度[℃]。derate_startから下げ始め、shutdownで0にする
+			u8 derate_start{60};
+			u8 shutdown{90};
+		};
+
+		private:
+		const Config config;
+		const float tick_period;
+
+		float heat{0.0f};
+		i16 limit{0};
+
+		public:
+		ThermalLimiter(const float tick_period, const Config& config) noexcept:
+			config(config),
+			tick_period(tick_period),
+			limit(config.peak)
+		{}
+
+		/// @brief 制御周期ごとに呼ぶ
+		void update(const Feedback& feedback) noexcept
+		{
+			const float current = feedback.current;
+			heat += (current * current - config.continuous * config.continuous) * tick_period;
+			heat = std::max(0.0f, std::min(config.heat_capacity, heat));
+
+			const float i2t_limit = config.peak - (config.peak - config.continuous) * (heat / config.heat_capacity);
+
+			float temperature_ratio = 1.0f;
+			if(feedback.temperature >= config.shutdown)
+			{
+				temperature_ratio = 0.0f;
+			}
+			else if(feedback.temperature > config.derate_start)
+			{
+				temperature_ratio = static_cast<float>(config.shutdown - feedback.temperature) / (config.shutdown - config.derate_start);
+			}
+
+			limit = i2t_limit * temperature_ratio;
+		}
+
+		/// @brief 現在の電流の上限(非負)
+		i16 get_limit() const noexcept
+		{
+			return limit;
+		}
+
+		i16 clamp(const i16 current) const noexcept
+		{
+			return std::max<i16>(-limit, std::min<i16>(limit, current));
+		}
+
+		/// @brief 溜まった熱の割合[%]
+		u8 get_heat_percent() const noexcept
+		{
+			return static_cast<u8>(heat * 100 / config.heat_capacity);
+		}
+	};
+}
@@ -2,5 +2,13 @@
 
 #ifdef __cplusplus
 extern "C"
+{
 #endif
 void main_cpp(void);
+
+// 起動時間の計測用。main()の最初とSystemClock_Configの後で呼ぶ
+void boot_timing_start(void);
+void boot_timing_clock_ready(void);
+#ifdef __cplusplus
+}
+#endif
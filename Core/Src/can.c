@@ -35,7 +35,7 @@ void MX_CAN_Init(void)
   /* USER CODE END CAN_Init 0 */
 
   /* USER CODE BEGIN CAN_Init 1 */
-
+  /* Bit timing is shared with the bootloader (Core/Inc/boot_layout.hpp). Change both together. */
   /* USER CODE END CAN_Init 1 */
   hcan.Instance = CAN1;
   hcan.Init.Prescaler = 16;
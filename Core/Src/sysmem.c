@@ -22,8 +22,23 @@
 
 /* Includes */
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#ifdef NHK23_SERVO_NO_HEAP
+/**
+ * Heap-free build: there is no definition of this function anywhere, so any
+ * code that pulls in _sbrk (malloc, operator new, ...) fails to link with an
+ * undefined reference to it. With --gc-sections nothing is reported as long
+ * as _sbrk itself is unused.
+ */
+extern void *nhk23_servo_heap_is_disabled(ptrdiff_t incr);
+
+void *_sbrk(ptrdiff_t incr)
+{
+  return nhk23_servo_heap_is_disabled(incr);
+}
+#else
 /**
  * Pointer to the current high watermark of the heap usage
  */
@@ -77,3 +92,4 @@ void *_sbrk(ptrdiff_t incr)
 
   return (void *)prev_heap_end;
 }
+#endif /* NHK23_SERVO_NO_HEAP */
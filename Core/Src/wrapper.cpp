@@ -1,4 +1,6 @@
 #include <array>
+#include <tuple>
+#include <type_traits>
 
 #include "can.h"
 #include "tim.h"
@@ -9,10 +11,26 @@
 #include <CRSLibtmp/Can/Stm32/RM0008/filter_manager.hpp>
 
 #include "injector.hpp"
+#include "identification.hpp"
+#include "servo_bank.hpp"
+#include "group_fire.hpp"
+#include "cycle_counter.hpp"
+#include "backup_domain.hpp"
+#include "param_store.hpp"
+#include "thermal_limiter.hpp"
+#include "cycle_stats.hpp"
+#include "ram_func.hpp"
+#include "can_fast.hpp"
+#include "boot_timing.hpp"
+#include "boot_control.hpp"
+#include "command_watchdog.hpp"
+#include "bulk_transfer.hpp"
+#include "black_box.hpp"
+#include "histogram.hpp"
+#include "can_counters.hpp"
 
-//PA9 TIM1_CH2
-//__HAL_TIM_SET_COMPARE(&htim1,TIM_CHANNEL_2,???)
-//???に390で右、700で正面、1100で左
+//PA8~PA11 TIM1_CH1~CH4
+//サーボのパルス幅はservo.hppを参照
 
 using namespace CRSLib::IntegerTypes;
 using namespace CRSLib::Can::Stm32::RM0008;
@@ -22,13 +40,31 @@ const char * error_msg{nullptr};
 namespace Nhk23Servo
 {
 	void init_can_other() noexcept;
+	void init_injectors() noexcept;
+	void save_homed_offsets() noexcept;
+	void load_params() noexcept;
+	std::optional<u32> get_live_param(u16 key) noexcept;
 
-	void fifo0_callback(const ReceivedMessage& message) noexcept;
+	NHK23_SERVO_RAM_FUNC bool fifo0_callback(const ReceivedMessage& message) noexcept;
+	bool is_command(u32 id) noexcept;
 	void servo_callback(const ReceivedMessage& message) noexcept;
-	void inject_callback(const ReceivedMessage& message) noexcept;
+	void servo_bank_callback(const ReceivedMessage& message) noexcept;
+	NHK23_SERVO_RAM_FUNC void inject_callback(const ReceivedMessage& message) noexcept;
+	void identification_start_callback(const ReceivedMessage& message) noexcept;
+	void identification_read_callback(const ReceivedMessage& message) noexcept;
+	void diagnostic_callback(const ReceivedMessage& message) noexcept;
+	void group_fire_callback(const ReceivedMessage& message) noexcept;
+	void homing_callback(const ReceivedMessage& message) noexcept;
+	void jam_config_callback(const ReceivedMessage& message) noexcept;
+	void feedforward_callback(const ReceivedMessage& message) noexcept;
+	void param_callback(const ReceivedMessage& message) noexcept;
+	void bootloader_callback(const ReceivedMessage& message) noexcept;
+	void heartbeat_callback(const ReceivedMessage& message) noexcept;
+	void bulk_callback(const ReceivedMessage& message) noexcept;
+	void black_box_callback(const ReceivedMessage& message) noexcept;
 
-	void fifo1_callback(const ReceivedMessage& message) noexcept;
-	void motor_state_callback(const ReceivedMessage& message) noexcept;
+	NHK23_SERVO_RAM_FUNC bool fifo1_callback(const ReceivedMessage& message) noexcept;
+	NHK23_SERVO_RAM_FUNC void motor_state_callback(const ReceivedMessage& message) noexcept;
 
 	enum Index : u8
 	{
@@ -37,77 +73,506 @@ namespace Nhk23Servo
 		Trunk
 	};
 
-//	std::array<Injector, 3> injectors
-//	{
-//		Injector{20.35, CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}},
-//		Injector{18.75, CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}},
-//		Injector{14.85, CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}}
-//	};
+	// falseの間は状態機械を使わず、inject_callbackで受けた射出を電流の直接指令で行う
+	constexpr bool use_state_machine = false;
+
+	// trueならHALを通さず、CanFastでメールボックスを直接読み書きする
+	constexpr bool use_can_fast = true;
+	using Bus = std::conditional_t<use_can_fast, CanFast, CanBus>;
+
+	std::array<Injector, 3> injectors
+	{
+		Injector{20.35, CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}},
+		Injector{18.75, CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}},
+		Injector{14.85, CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}}
+	};
+
+	GroupFire<3> group_fire{};
+
+	// 制御周期[ms]
+	constexpr u32 control_period_ms = 2;
+
+	// 送信するID
+	constexpr u32 identification_sample_id = 0x150;
+	constexpr u32 servo_settle_id = 0x151;
+	constexpr u32 group_fire_report_id = 0x152;
+	constexpr u32 param_reply_id = 0x153;
+	constexpr u32 diagnostic_reply_id = 0x15F;
+	// C620の0x200~0x203より後ろに置き、調停で制御の通信に譲る
+	constexpr u32 bulk_reply_id = 0x3F0;
+	constexpr u32 all_mailboxes_empty = CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2;
+
+	// 診断情報の種類。0x14Fの[0]で指定し、0x15Fの[0]で返す
+	enum class Diagnostic : u8
+	{
+		ShotCounter,  // [1]: インジェクター, [2-3]: queued, [4-5]: fired, [6-7]: dropped
+		Thermal,  // [1]: モーター, [2-3]: 電流の上限, [4]: 温度[℃], [5]: 溜まった熱[%]
+		Jam,  // [1]: インジェクター, [2-3]: 詰まりの回数, [4-5]: やり直した回数, [6-7]: Faultになった回数
+		Cycles,  // [1]: 0なら制御周期の処理、1ならCANの受信処理、2ならドライバの受信、3ならドライバの送信, [2-3]: 最小, [4-5]: 最大, [6-7]: 平均。単位はサイクル。読むと数え直す
+		Feedforward,  // [1]: インジェクター, [2]: 係数(Feedforward::Coefficient), [4-7]: 係数の値(float)
+		Boot,  // [1]: 段階(BootTiming::Mark), [2]: 1なら到達済み, [4-7]: main()からの時間[us]
+		StateStats,  // [1]: インジェクター, [2]: 状態(Injector::ControlState), [3]: 今の状態, [4-5]: 入った回数, [6-7]: 1回の処理の最大サイクル数
+		Watchdog,  // [2-3]: 途絶えたとみなす時間[ms], [4-5]: 途絶えた回数, [6]: 今途絶えているチャンネルのビット集合
+		BlackBox,  // [1]: 間引き, [2]: トリガ(BlackBox::Trigger), [3]: 1なら止まっている, [4-5]: 記録の件数, [6-7]: トリガの直後の記録の番号
+		Jitter,  // [1]: 0ならメインループ1周の時間、1なら制御周期の間隔, [2-3]: 中央値, [4-5]: 99パーセンタイル, [6-7]: 最大。単位はus。読むと数え直す
+		CanFifo,  // [1]: FIFO, [2-3]: 受信した数, [4-5]: どのコールバックにも渡さなかった数, [6]: FOVRの回数, [7]: FULLの回数。全て下位ビットのみ
+		MessageCount,  // [1]: 種類(Message), [4-7]: 受信した数
+		FeedbackRate,  // [1]: モーター, [2-3]: 直前1秒のフィードバックの数[Hz](C620は1000), [4-7]: 受信した数
+
+		N
+	};
+
+	struct DiagnosticRequest final
+	{
+		Diagnostic kind;
+		u8 index;
+		u8 sub_index;
+	};
+
+	// 処理にかかったサイクル数。NHK23_SERVO_RAM_FUNC_IN_FLASHの有無で比べる
+	CycleStats control_cycles{};
+	CycleStats receive_cycles{};
+	// ドライバの1フレームあたりのサイクル数。use_can_fastの有無で比べる
+	CycleStats driver_receive_cycles{};
+	CycleStats driver_post_cycles{};
+
+	// trueならメインループ1周の時間と制御周期の間隔の分布を取る。1周あたり数十サイクルかかる
+	constexpr bool use_jitter_histogram = true;
+	// メインループ1周の時間[us]。FIFOを読む間隔の最悪値になる
+	LogHistogram<> loop_period_us{};
+	// 制御周期の間隔[us]。HAL_GetTick()で測るので、control_period_msの前後1msに散らばる
+	LogHistogram<> control_interval_us{};
+
+	// 数える受信メッセージの種類。fifo0_callbackとfifo1_callbackで振り分けたもの
+	enum class Message : u8
+	{
+		Servo,
+		ServoBank,
+		Inject,
+		IdentificationStart,
+		IdentificationRead,
+		GroupFire,
+		Homing,
+		JamConfig,
+		Feedforward,
+		Param,
+		Bootloader,
+		Heartbeat,
+		Bulk,
+		BlackBox,
+		Diagnostic,
+		MotorState,
+
+		N
+	};
+	std::array<FifoCounters, 2> fifo_counters{};
+	std::array<u32, static_cast<u8>(Message::N)> message_counts{};
+	RateMeter<3> feedback_rate{};
+
+	inline void count_message(const Message message) noexcept
+	{
+		++message_counts[static_cast<u8>(message)];
+	}
+
+	BootTiming boot_timing{};
+	bool boot_confirmed{false};
+	bool bootloader_request{false};
+	std::optional<DiagnosticRequest> diagnostic_request{};
+	void post_diagnostic(Bus& can_bus, const DiagnosticRequest& request) noexcept;
+
+	std::array<MotorState, 3> motor_states{};
+
+	ServoBank servos{htim1};
+	// 1チャンネル指定のサーボ指令でチャンネルを省略したときはCH2(PA9)
+	constexpr u8 default_servo_channel = 1;
+	bool servo_settle_request{false};
+
+	// 指令が途絶えたら止めるチャンネル。0~2はインジェクター(Index)
+	constexpr u8 servo_watchdog_channel = 3;
+	// 0x148のハートビートか各チャンネルへの指令がこれだけ来なければ、電流を0へ下げてサーボを中央へ戻す。
+	// ハートビートを一度も受けていなければ止めない。ハートビートを送らない上位では、指令の合間を途絶えたと取り違えるため
+	constexpr u32 default_watchdog_timeout_ms = 200;
+	// 電流の上限を制御周期ごとに下げる量。最大から約60msで0
+	constexpr i16 watchdog_ramp_step = 0x2'00;
+	CommandWatchdog<4> watchdog{default_watchdog_timeout_ms, watchdog_ramp_step};
+	void stop_expired(u16 expired_mask) noexcept;
+
+	/// @brief ブラックボックスの1件。値は全てビッグエンディアンで送る
+	struct ControlRecord final
+	{
+		struct Motor final
+		{
+			i16 command;  // 直前にC620へ送った電流
+			i16 angle;
+			i16 speed;
+			i16 current;
+		};
+
+		u16 time_ms;  // HAL_GetTick()の下位16bit
+		u16 states;  // 4bitずつInjector::ControlState。TuskLが最下位
+		std::array<Motor, 3> motors;
+	};
+	static_assert(sizeof(ControlRecord) == 28);
+
+	// 256件で7KB。既定の4周期(8ms)ごとなら約2秒分
+	BlackBox<ControlRecord, 256> black_box{4};
+	std::array<i16, 3> last_commands{};
+	u32 last_jam_total{0};
+	void record_black_box(u32 now) noexcept;
+
+	std::array<ThermalLimiter, 3> thermal_limiters
+	{
+		ThermalLimiter{control_period_ms / 1000.0f, ThermalLimiter::Config{}},
+		ThermalLimiter{control_period_ms / 1000.0f, ThermalLimiter::Config{}},
+		ThermalLimiter{control_period_ms / 1000.0f, ThermalLimiter::Config{}}
+	};
+
+	Identification identification{control_period_ms / 1000.0f};
+	std::optional<u16> identification_read_request{};
+	// 0x145で係数を求めるインジェクター。最小二乗法は重いので、受信処理ではなくメインループで求める
+	std::optional<u8> feedforward_fit_request{};
+	void fit_feedforward(u8 which) noexcept;
+
+	// 0x149で要求し、0x3F0で分割して受け取るデータ
+	enum class Bulk : u8
+	{
+		Identification,  // システム同定の記録。1サンプル8byteで[0-1]: 指令, [2-3]: 角度, [4-5]: 速度, [6-7]: 電流(0x150と同じ)
+		BlackBox,  // 止まっているときだけ。[0]: トリガ, [1]: 間引き, [2-3]: トリガの直後の記録の番号, 以降ControlRecordを古い順に28byteずつ
+
+		N
+	};
+	BulkSender bulk_sender{};
+	Bulk bulk_kind{Bulk::N};  // 送っている、または最後に送った種類
+	std::optional<BulkSource> make_bulk_source(Bulk kind) noexcept;
+
+	// フラッシュに保存するパラメータのキー
+	enum Param : u16
+	{
+		BarrelOffset,  // +インジェクター。i32。次の起動から使う
+		InjectDuration = BarrelOffset + 3,  // i32[ms]
+		InjectSpeedMax,  // i32
+		FeedforwardCoefficient,  // +インジェクター * Feedforward::N + 係数。float
+
+		WatchdogTimeout = FeedforwardCoefficient + 3 * Feedforward::N,  // u32[ms]
+
+		ParamN
+	};
+	ParamStore<ParamN> params{};
+	std::optional<u16> param_read_request{};
+	// 0x146で保存を要求された。フラッシュの書き込みは長いので、受信処理ではなくメインループで行う
+	bool param_save_request{false};
+	// 0x153の[0-1]がこれなら保存の結果
+	constexpr u16 param_save_reply_key = 0xFF'FF;
+	bool save_params() noexcept;
+
+	void write_i16(CRSLib::Can::DataField& data, const u8 offset, const i16 value) noexcept
+	{
+		data.buffer[offset] = (byte)((value & 0xFF'00) >> 8);
+		data.buffer[offset + 1] = (byte)(value & 0x00'FF);
+	}
+
+	void write_u32(CRSLib::Can::DataField& data, const u8 offset, const u32 value) noexcept
+	{
+		write_i16(data, offset, value >> 16);
+		write_i16(data, offset + 2, value & 0xFF'FF);
+	}
+
+	u16 read_u16(const CRSLib::Can::DataField& data, const u8 offset) noexcept
+	{
+		return (u32)data.buffer[offset] << 8 | (u32)data.buffer[offset + 1];
+	}
 }
 
 i16 speed = 0;
-Nhk23Servo::Index selected = Nhk23Servo::TuskL;
+u8 selected_mask = 1u << Nhk23Servo::TuskL;
 u32 time = 0;
 volatile i32 duration = 100;
 volatile i32 speed_max = 0x3c'00;
 volatile int debug_var = 0;
 
 volatile int hoge = 0;
+
+extern "C" void boot_timing_start()
+{
+	Nhk23Servo::CycleCounter::enable();
+}
+
+extern "C" void boot_timing_clock_ready()
+{
+	Nhk23Servo::boot_timing.mark(Nhk23Servo::BootTiming::ClockReady);
+}
+
 extern "C" void main_cpp()
 {
+	// サイクルカウンタはmain()の最初で有効にしてある
 
-	// PWMなど初期化
-	HAL_TIM_PWM_Start(&htim1,TIM_CHANNEL_2);
+	// 調整したパラメータを読み込む
+	Nhk23Servo::load_params();
+
+	// バスに早く戻れるよう、CANを最初に始める
 	// *先に*フィルタの初期化を行う。先にCanBusを初期化すると先にNormalModeに以降してしまい、これはRM0008に違反する。
 	Nhk23Servo::init_can_other();
 	// 通信開始
-	CanBus can_bus{can1};
+	CanBus can_bus_crs{can1};
+	Nhk23Servo::boot_timing.mark(Nhk23Servo::BootTiming::CanReady);
+	// 初期化はCanBusで行い、送受信はuse_can_fastに応じてどちらかで行う
+	Nhk23Servo::CanFast can_fast{*CAN1};
+	Nhk23Servo::Bus& can_bus = std::get<Nhk23Servo::Bus&>(std::tie(can_bus_crs, can_fast));
+
+	// C620への電流指令値の送信
+	const auto post_current = [&can_bus](const CRSLib::Can::DataField& data) noexcept
+	{
+		const u32 start = Nhk23Servo::CycleCounter::now();
+		(void)can_bus.post(0x200, data);
+		Nhk23Servo::driver_post_cycles.add(Nhk23Servo::CycleCounter::now() - start);
+		for(u8 i = 0; i < Nhk23Servo::last_commands.size(); ++i) Nhk23Servo::last_commands[i] = CRSLib::bit_cast<i16>(Nhk23Servo::read_u16(data, 2 * i));
+		Nhk23Servo::boot_timing.mark(Nhk23Servo::BootTiming::FirstPost);
+	};
+
+	if constexpr(Nhk23Servo::use_state_machine)
+	{
+		Nhk23Servo::init_injectors();
+	}
+
+	// PWMなど初期化
+	Nhk23Servo::servos.start();
 
 //	// まさか数日間動かすなんてことないだろ
 //	auto time = HAL_GetTick();
+	u32 control_time = HAL_GetTick();
+	u32 loop_cycle = Nhk23Servo::CycleCounter::now();
+	u32 control_cycle = loop_cycle;
 
 	while(true)
 	{
+		// 確認されていないイメージでは、ブートローダがIWDGを始めている
+		Nhk23Servo::BootControl::refresh_watchdog();
+
+		if constexpr(Nhk23Servo::use_jitter_histogram)
+		{
+			const u32 now = Nhk23Servo::CycleCounter::now();
+			Nhk23Servo::loop_period_us.add((now - loop_cycle) / Nhk23Servo::CycleCounter::cycles_per_us);
+			loop_cycle = now;
+		}
+
+		// PWMの1周期ごとにサーボの比較値を更新
+		if(__HAL_TIM_GET_FLAG(&htim1, TIM_FLAG_UPDATE))
+		{
+			htim1.Instance->SR = ~static_cast<u32>(TIM_SR_UIF);
+			Nhk23Servo::servos.update();
+		}
+
+		// 受信FIFOが溢れていないか。割り込みを使わないので、ここで見てクリアする
+		Nhk23Servo::fifo_counters[0].check_flags(CAN1->RF0R);
+		Nhk23Servo::fifo_counters[1].check_flags(CAN1->RF1R);
+
 		// FIFO0の受信
 		{
+			const u32 receive_start = Nhk23Servo::CycleCounter::now();
 			const auto message = can_bus.receive(Fifo::Fifo0);
-			if(message) Nhk23Servo::fifo0_callback(*message);
+			if(message)
+			{
+				const u32 start = Nhk23Servo::CycleCounter::now();
+				Nhk23Servo::driver_receive_cycles.add(start - receive_start);
+				Nhk23Servo::boot_timing.mark(Nhk23Servo::BootTiming::FirstReceive);
+				++Nhk23Servo::fifo_counters[0].received;
+				if(Nhk23Servo::fifo0_callback(*message)) ++Nhk23Servo::fifo_counters[0].dispatched;
+				if(Nhk23Servo::is_command(message->id)) Nhk23Servo::boot_timing.mark(Nhk23Servo::BootTiming::FirstCommand);
+				Nhk23Servo::receive_cycles.add(Nhk23Servo::CycleCounter::now() - start);
+			}
 		}
 
 		// FIFO1の受信
 		{
+			const u32 receive_start = Nhk23Servo::CycleCounter::now();
 			const auto message = can_bus.receive(Fifo::Fifo1);
-			if(message) Nhk23Servo::fifo1_callback(*message);
-		}
-
-//		// C620へ電流指令値を送信
-//		if(const auto now = HAL_GetTick(); now - time >= 2)
-//		{
-//			CRSLib::Can::DataField data{.buffer={}, .dlc=8};
-//			for(u8 i = 0; auto& injector : Nhk23Servo::injectors)
-//			{
-//				const i16 target = injector.run_and_calc_target();
-//				std::memcpy(data.buffer + sizeof(i16) * i, &target, sizeof(i16));
-//				++i;
-//			}
-//
-//			hoge = 1;
-//			(void)can_bus.post(0x200, data);
-//
-//			time = now;
-//		}
-		if(const auto now = HAL_GetTick(); speed != 0 && now - time > duration)
-		{
-			speed = 0;
+			if(message)
+			{
+				const u32 start = Nhk23Servo::CycleCounter::now();
+				Nhk23Servo::driver_receive_cycles.add(start - receive_start);
+				Nhk23Servo::boot_timing.mark(Nhk23Servo::BootTiming::FirstReceive);
+				++Nhk23Servo::fifo_counters[1].received;
+				if(Nhk23Servo::fifo1_callback(*message)) ++Nhk23Servo::fifo_counters[1].dispatched;
+				Nhk23Servo::receive_cycles.add(Nhk23Servo::CycleCounter::now() - start);
+			}
+		}
+
+		// C620へ電流指令値を送信
+		if(const auto now = HAL_GetTick(); now - control_time >= Nhk23Servo::control_period_ms)
+		{
+			control_time = now;
+
+			if constexpr(Nhk23Servo::use_jitter_histogram)
+			{
+				const u32 cycle = Nhk23Servo::CycleCounter::now();
+				Nhk23Servo::control_interval_us.add((cycle - control_cycle) / Nhk23Servo::CycleCounter::cycles_per_us);
+				control_cycle = cycle;
+			}
+			CRSLib::Can::DataField data{.buffer={}, .dlc=8};
+
+			for(u8 i = 0; auto& limiter : Nhk23Servo::thermal_limiters)
+			{
+				limiter.update(Nhk23Servo::motor_states[i].feedback);
+				++i;
+			}
+
+			// 指令が途絶えたチャンネルを止める
+			if(const u16 expired = Nhk23Servo::watchdog.check(now); expired) Nhk23Servo::stop_expired(expired);
+
+			Nhk23Servo::record_black_box(now);
+			Nhk23Servo::feedback_rate.update(now);
+
+			// システム同定中は励起信号のみを送信する。他のモーターは0
+			if(Nhk23Servo::identification.is_running())
+			{
+				const u8 motor = Nhk23Servo::identification.target_motor();
+				const auto limit = [motor](const i16 command) noexcept
+				{
+					return Nhk23Servo::watchdog.clamp(motor, Nhk23Servo::thermal_limiters[motor].clamp(command));
+				};
+				Nhk23Servo::write_i16(data, 2 * motor, Nhk23Servo::identification.run_and_calc_target(Nhk23Servo::motor_states[motor].feedback, limit));
+				post_current(data);
+			}
+			else if constexpr(Nhk23Servo::use_state_machine)
+			{
+				const u32 start = Nhk23Servo::CycleCounter::now();
+
+				// 同時射出は全インジェクターの計算より先に開始する
+				Nhk23Servo::group_fire.run(Nhk23Servo::injectors, now);
+
+				for(u8 i = 0; auto& injector : Nhk23Servo::injectors)
+				{
+					const i16 target = injector.run_and_calc_target(now, Nhk23Servo::thermal_limiters[i].get_limit());
+					Nhk23Servo::write_i16(data, 2 * i, Nhk23Servo::watchdog.clamp(i, target));
+					++i;
+				}
+				Nhk23Servo::control_cycles.add(Nhk23Servo::CycleCounter::now() - start);
+
+				hoge = 1;
+				post_current(data);
+			}
+		}
+
+		if constexpr(Nhk23Servo::use_state_machine)
+		{
+			Nhk23Servo::save_homed_offsets();
+		}
+
+		// サーボの推定整定時間[ms]を返す
+		if(Nhk23Servo::servo_settle_request)
+		{
+			Nhk23Servo::servo_settle_request = false;
+			CRSLib::Can::DataField data{.buffer={}, .dlc=2};
+			Nhk23Servo::write_i16(data, 0, std::min<u32>(Nhk23Servo::servos.estimate_settle_ms(), 0x7F'FF));
+			(void)can_bus.post(Nhk23Servo::servo_settle_id, data);
+		}
+
+		// 記録したサンプルの読み出し
+		if(const auto index = Nhk23Servo::identification_read_request; index)
+		{
+			Nhk23Servo::identification_read_request.reset();
+			if(const auto sample = Nhk23Servo::identification.get_sample(*index); sample)
+			{
+				CRSLib::Can::DataField data{.buffer={}, .dlc=8};
+				Nhk23Servo::write_i16(data, 0, sample->command);
+				Nhk23Servo::write_i16(data, 2, sample->angle);
+				Nhk23Servo::write_i16(data, 4, sample->speed);
+				Nhk23Servo::write_i16(data, 6, sample->current);
+				(void)can_bus.post(Nhk23Servo::identification_sample_id, data);
+			}
+		}
+
+		// フィードフォワード係数を求める
+		if(const auto which = Nhk23Servo::feedforward_fit_request; which)
+		{
+			Nhk23Servo::feedforward_fit_request.reset();
+			Nhk23Servo::fit_feedforward(*which);
+		}
+
+		// パラメータの読み出し
+		if(const auto key = Nhk23Servo::param_read_request; key)
+		{
+			Nhk23Servo::param_read_request.reset();
+			const auto value = Nhk23Servo::params.get(*key);
 			CRSLib::Can::DataField data{.buffer={}, .dlc=8};
-			(void)can_bus.post(0x200, data);
+			Nhk23Servo::write_i16(data, 0, *key);
+			data.buffer[2] = (byte)value.has_value();
+			Nhk23Servo::write_i16(data, 4, value.value_or(0) >> 16);
+			Nhk23Servo::write_i16(data, 6, value.value_or(0) & 0xFF'FF);
+			(void)can_bus.post(Nhk23Servo::param_reply_id, data);
 		}
-		if(speed != 0)
+
+		// パラメータの保存。結果を返す
+		if(Nhk23Servo::param_save_request)
+		{
+			Nhk23Servo::param_save_request = false;
+			CRSLib::Can::DataField data{.buffer={}, .dlc=3};
+			Nhk23Servo::write_i16(data, 0, Nhk23Servo::param_save_reply_key);
+			data.buffer[2] = (byte)Nhk23Servo::save_params();
+			(void)can_bus.post(Nhk23Servo::param_reply_id, data);
+		}
+
+		// 同時射出の結果とずれを返す
+		if(const auto report = Nhk23Servo::group_fire.take_report(); report)
+		{
+			CRSLib::Can::DataField data{.buffer={}, .dlc=6};
+			data.buffer[0] = (byte)report->mask;
+			data.buffer[1] = (byte)report->result;
+			Nhk23Servo::write_i16(data, 2, report->skew_cycles >> 16);
+			Nhk23Servo::write_i16(data, 4, report->skew_cycles & 0xFF'FF);
+			(void)can_bus.post(Nhk23Servo::group_fire_report_id, data);
+		}
+
+		// 診断情報を返す
+		if(const auto request = Nhk23Servo::diagnostic_request; request)
+		{
+			Nhk23Servo::diagnostic_request.reset();
+			Nhk23Servo::post_diagnostic(can_bus, *request);
+		}
+
+		// 分割転送は送信メールボックスが全て空いているときだけ、1フレームずつ送る
+		if(Nhk23Servo::bulk_sender.is_busy() && (CAN1->TSR & Nhk23Servo::all_mailboxes_empty) == Nhk23Servo::all_mailboxes_empty)
+		{
+			const u32 now = Nhk23Servo::CycleCounter::now();
+			if(const auto frame = Nhk23Servo::bulk_sender.peek(now); frame && can_bus.post(Nhk23Servo::bulk_reply_id, *frame))
+			{
+				Nhk23Servo::bulk_sender.advance(now);
+			}
+		}
+
+		// 上位から指令を受けられたら起動に成功したとみなし、ブートローダが前のスロットに戻さないようにする。C620のフィードバックだけでは確認しない
+		if(!Nhk23Servo::boot_confirmed && Nhk23Servo::boot_timing.is_marked(Nhk23Servo::BootTiming::FirstCommand))
+		{
+			Nhk23Servo::boot_confirmed = true;
+			Nhk23Servo::BootControl::confirm();
+		}
+
+		// 電流を0にしてからブートローダへ
+		if(Nhk23Servo::bootloader_request)
 		{
 			CRSLib::Can::DataField data{.buffer={}, .dlc=8};
-			data.buffer[2 * selected] = (byte)((speed & 0xFF'00) >> 8);
-			data.buffer[2 * selected + 1] = (byte)(speed & 0x00'FF);
-			(void)can_bus.post(0x200, data);
+			post_current(data);
+			HAL_Delay(Nhk23Servo::control_period_ms);
+			Nhk23Servo::BootControl::enter_bootloader();
+		}
+
+		if constexpr(!Nhk23Servo::use_state_machine)
+		{
+			if(const auto now = HAL_GetTick(); speed != 0 && duration >= 0 && now - time > static_cast<u32>(duration))
+			{
+				speed = 0;
+				CRSLib::Can::DataField data{.buffer={}, .dlc=8};
+				post_current(data);
+			}
+			if(speed != 0)
+			{
+				CRSLib::Can::DataField data{.buffer={}, .dlc=8};
+				for(u8 i = 0; i < 3; ++i)
+				{
+					if(selected_mask >> i & 1u) Nhk23Servo::write_i16(data, 2 * i, Nhk23Servo::watchdog.clamp(i, Nhk23Servo::thermal_limiters[i].clamp(speed)));
+				}
+				post_current(data);
+			}
 		}
 	}
 }
@@ -116,24 +581,38 @@ extern "C" void main_cpp()
 namespace Nhk23Servo
 {
 	constexpr u32 servo_id = 0x110;
+	constexpr u32 servo_bank_id = 0x111;
 	constexpr u32 inject_speed_id_base = 0x120;  // 0x120-0x122
 	constexpr u32 inject_speed_id_mask = 0x7FC;
 	constexpr u32 inject_feedback_id_base = 0x130;  // 0x130-0x132
 	constexpr u32 inject_feedback_id_mask = 0x7FC;
 	constexpr u32 motor_state_id_base = 0x201;  // 0x201-0x203
 	constexpr u32 motor_state_id_mask = 0x7FC;
+	constexpr u32 command_id_base = 0x140;  // 0x140-0x14F
+	constexpr u32 command_id_mask = 0x7F0;
+	constexpr u32 identification_start_id = 0x140;
+	constexpr u32 identification_read_id = 0x141;
+	constexpr u32 group_fire_id = 0x142;
+	constexpr u32 homing_id = 0x143;
+	constexpr u32 jam_config_id = 0x144;
+	constexpr u32 feedforward_id = 0x145;
+	constexpr u32 param_id = 0x146;
+	constexpr u32 bootloader_id = 0x147;
+	constexpr u32 heartbeat_id = 0x148;
+	constexpr u32 bulk_id = 0x149;
+	constexpr u32 black_box_id = 0x14A;
+	constexpr u32 diagnostic_id = 0x14F;
 
 	void init_can_other() noexcept
 	{
-		// ここでCANのMSP(ピンやクロックなど。ここまで書ききるのはキツかった...)の初期化を行う
-		HAL_CAN_DeInit(&hcan);
-		HAL_CAN_MspInit(&hcan);
+		// CANのMSP(ピンやクロックなど)とビットタイミングはMX_CAN_Initで設定済みで、初期化モードのまま。ここでやり直すと起動が遅くなるだけ
 
 		enum FilterName : u8
 		{
 			Servo,
 			InjectSpeed,
 			MotorState,
+			Command,
 
 			N
 		};
@@ -142,11 +621,12 @@ namespace Nhk23Servo
 		filter_configs[Servo] = FilterConfig::make_default(Fifo::Fifo0);
 		filter_configs[InjectSpeed] = FilterConfig::make_default(Fifo::Fifo0, false);
 		filter_configs[MotorState] = FilterConfig::make_default(Fifo::Fifo1, false);
+		filter_configs[Command] = FilterConfig::make_default(Fifo::Fifo0, false);
 
 		// ここでフィルタの初期化を行う
 		FilterManager::initialize(filter_bank_size, filter_configs);
 
-		if(!FilterManager::set_filter(Servo, Filter{.FR1=FilterManager::make_list32(servo_id), .FR2=0}))
+		if(!FilterManager::set_filter(Servo, Filter{.FR1=FilterManager::make_list32(servo_id), .FR2=FilterManager::make_list32(servo_bank_id)}))
 		{
 			error_msg = "Fail to set filter for Servo";
 			Error_Handler();
@@ -167,6 +647,179 @@ namespace Nhk23Servo
 			Error_Handler();
 		}
 		FilterManager::activate(MotorState);
+
+		if(!FilterManager::set_filter(Command, FilterManager::make_mask32(command_id_base, command_id_mask)))
+		{
+			error_msg = "Fail to set filter for Command";
+			Error_Handler();
+		}
+		FilterManager::activate(Command);
+	}
+
+	/// @brief リセットだけなら保存しておいた原点と位置を使う
+	/// @details 電源を入れたときは砲身の位置が分からないが、指令なしに動かさないよう原点出しはしない。0x143で原点出しをするまでは起動したときの角度が原点
+	void init_injectors() noexcept
+	{
+		BackupDomain::enable();
+		if(!BackupDomain::is_warm_boot()) return;
+
+		for(u8 i = 0; i < injectors.size(); ++i)
+		{
+			if(!params.get(BarrelOffset + i)) return;
+		}
+
+		for(u8 i = 0; auto& injector : injectors)
+		{
+			injector.restore(CRSLib::bit_cast<i32>(*params.get(BarrelOffset + i)), BackupDomain::load_position(i));
+			++i;
+		}
+	}
+
+	/// @brief どのモーターにも電流を指令していない。フラッシュに書き込んでよいとき
+	bool is_current_zero() noexcept
+	{
+		for(const i16 command : last_commands)
+		{
+			if(command != 0) return false;
+		}
+		return true;
+	}
+
+	// 原点出しで見つけた原点を、まだフラッシュに保存していない
+	bool homed_offsets_pending{false};
+
+	/// @brief 原点出しが終わったインジェクターがあれば、全インジェクターの原点をフラッシュに保存する
+	/// @details 原点出しの直後はSettingUpで回しているので、save_paramsと同じくどのモーターにも電流を指令しなくなるまで持ち越す
+	void save_homed_offsets() noexcept
+	{
+		for(auto& injector : injectors)
+		{
+			if(injector.take_homed_offset()) homed_offsets_pending = true;
+		}
+		if(!homed_offsets_pending || !is_current_zero()) return;
+
+		homed_offsets_pending = false;
+		for(u8 i = 0; i < injectors.size(); ++i)
+		{
+			(void)params.set(BarrelOffset + i, CRSLib::bit_cast<u32>(injectors[i].get_barrel_offset()));
+		}
+	}
+
+	/// @brief 制御周期ごとに呼ぶ。Faultに入ったか詰まりが増えたらブラックボックスを止める
+	void record_black_box(const u32 now) noexcept
+	{
+		u32 jam_total = 0;
+		for(const auto& injector : injectors)
+		{
+			jam_total += injector.get_jam_counter().jams;
+			if(injector.get_control_state() == Injector::ControlState::Fault) black_box.fire(decltype(black_box)::Trigger::Fault);
+		}
+		if(jam_total != last_jam_total) black_box.fire(decltype(black_box)::Trigger::Jam);
+		last_jam_total = jam_total;
+
+		if(!black_box.is_due()) return;
+
+		ControlRecord record{.time_ms=(u16)now, .states=0, .motors={}};
+		for(u8 i = 0; i < injectors.size(); ++i)
+		{
+			const auto& feedback = motor_states[i].feedback;
+			record.states |= static_cast<u16>(injectors[i].get_control_state()) << (4 * i);
+			record.motors[i] = ControlRecord::Motor{.command=last_commands[i], .angle=feedback.angle, .speed=feedback.speed, .current=feedback.current};
+		}
+		black_box.push(record);
+	}
+
+	/// @brief 保存してあるパラメータを読み込んで反映する
+	void load_params() noexcept
+	{
+		if(!params.load()) return;
+
+		if(const auto value = params.get(InjectDuration); value) duration = CRSLib::bit_cast<i32>(*value);
+		if(const auto value = params.get(InjectSpeedMax); value) speed_max = CRSLib::bit_cast<i32>(*value);
+		for(u8 i = 0; i < injectors.size(); ++i)
+		{
+			auto feedforward = injectors[i].get_feedforward();
+			for(u8 coefficient = 0; coefficient < Feedforward::N; ++coefficient)
+			{
+				const auto value = params.get(FeedforwardCoefficient + i * Feedforward::N + coefficient);
+				if(value) feedforward[static_cast<Feedforward::Coefficient>(coefficient)] = CRSLib::bit_cast<float>(*value);
+			}
+			injectors[i].set_feedforward(feedforward);
+		}
+		if(const auto value = params.get(WatchdogTimeout); value) watchdog.set_timeout_ms(*value);
+	}
+
+	/// @brief 今使っているパラメータの値。砲身の原点は原点出しで保存するので含めない
+	std::optional<u32> get_live_param(const u16 key) noexcept
+	{
+		if(key < InjectDuration) return std::nullopt;
+		if(key == InjectDuration) return CRSLib::bit_cast<u32>((i32)duration);
+		if(key == InjectSpeedMax) return CRSLib::bit_cast<u32>((i32)speed_max);
+		if(key == WatchdogTimeout) return watchdog.get_timeout_ms();
+		if(key < WatchdogTimeout)
+		{
+			const u8 index = key - FeedforwardCoefficient;
+			auto feedforward = injectors[index / Feedforward::N].get_feedforward();
+			return CRSLib::bit_cast<u32>(feedforward[static_cast<Feedforward::Coefficient>(index % Feedforward::N)]);
+		}
+		return std::nullopt;
+	}
+
+	/// @brief 分割転送で送るデータ。送っている間に変わるものは要求を受けない
+	std::optional<BulkSource> make_bulk_source(const Bulk kind) noexcept
+	{
+		switch(kind)
+		{
+			case Bulk::Identification:
+			{
+				if(identification.is_running()) return std::nullopt;
+
+				constexpr auto read = [](const u32 offset) noexcept -> byte
+				{
+					const auto sample = identification.get_sample(offset / sizeof(Identification::Sample));
+					if(!sample) return byte{0};
+
+					const std::array<i16, 4> fields{sample->command, sample->angle, sample->speed, sample->current};
+					const u16 field = fields[offset % sizeof(Identification::Sample) / 2];
+					return (byte)(offset % 2 == 0 ? field >> 8 : field & 0xFF);
+				};
+				return BulkSource{.size=static_cast<u32>(identification.size() * sizeof(Identification::Sample)), .read=read};
+			}
+
+			case Bulk::BlackBox:
+			{
+				if(!black_box.is_frozen()) return std::nullopt;
+
+				constexpr u32 header_size = 4;
+				constexpr auto read = [](const u32 offset) noexcept -> byte
+				{
+					if(offset < header_size)
+					{
+						const u16 index = black_box.get_trigger_index();
+						const std::array<u8, header_size> header{(u8)black_box.get_trigger(), black_box.get_decimation(), (u8)(index >> 8), (u8)index};
+						return (byte)header[offset];
+					}
+
+					const u32 position = offset - header_size;
+					const auto& record = black_box[position / sizeof(ControlRecord)];
+					std::array<u16, sizeof(ControlRecord) / 2> fields{record.time_ms, record.states};
+					for(u8 i = 0; const auto& motor : record.motors)
+					{
+						fields[2 + 4 * i] = motor.command;
+						fields[3 + 4 * i] = motor.angle;
+						fields[4 + 4 * i] = motor.speed;
+						fields[5 + 4 * i] = motor.current;
+						++i;
+					}
+					const u16 field = fields[position % sizeof(ControlRecord) / 2];
+					return (byte)(position % 2 == 0 ? field >> 8 : field & 0xFF);
+				};
+				return BulkSource{.size=static_cast<u32>(header_size + black_box.size() * sizeof(ControlRecord)), .read=read};
+			}
+
+			default:
+			return std::nullopt;
+		}
 	}
 
 	//////// ここから下はコールバック関数 ////////
@@ -174,82 +827,665 @@ namespace Nhk23Servo
 
 	/// @brief fifo0のコールバック
 	/// @param message
-	void fifo0_callback(const ReceivedMessage& message) noexcept
+	bool fifo0_callback(const ReceivedMessage& message) noexcept
 	{
 		if(message.id == servo_id)
 		{
+			count_message(Message::Servo);
 			servo_callback(message);
 		}
-		else if(inject_speed_id_base <= message.id && message.id <= inject_speed_id_base + 2)
+		else if(message.id == servo_bank_id)
 		{
+			count_message(Message::ServoBank);
+			servo_bank_callback(message);
+		}
+		else if(inject_speed_id_base <= message.id && message.id <= inject_speed_id_base + Trunk)
+		{
+			count_message(Message::Inject);
 			inject_callback(message);
 		}
+		else if(message.id == identification_start_id)
+		{
+			count_message(Message::IdentificationStart);
+			identification_start_callback(message);
+		}
+		else if(message.id == identification_read_id)
+		{
+			count_message(Message::IdentificationRead);
+			identification_read_callback(message);
+		}
+		else if(message.id == group_fire_id)
+		{
+			count_message(Message::GroupFire);
+			group_fire_callback(message);
+		}
+		else if(message.id == homing_id)
+		{
+			count_message(Message::Homing);
+			homing_callback(message);
+		}
+		else if(message.id == jam_config_id)
+		{
+			count_message(Message::JamConfig);
+			jam_config_callback(message);
+		}
+		else if(message.id == feedforward_id)
+		{
+			count_message(Message::Feedforward);
+			feedforward_callback(message);
+		}
+		else if(message.id == param_id)
+		{
+			count_message(Message::Param);
+			param_callback(message);
+		}
+		else if(message.id == bootloader_id)
+		{
+			count_message(Message::Bootloader);
+			bootloader_callback(message);
+		}
+		else if(message.id == heartbeat_id)
+		{
+			count_message(Message::Heartbeat);
+			heartbeat_callback(message);
+		}
+		else if(message.id == bulk_id)
+		{
+			count_message(Message::Bulk);
+			bulk_callback(message);
+		}
+		else if(message.id == black_box_id)
+		{
+			count_message(Message::BlackBox);
+			black_box_callback(message);
+		}
+		else if(message.id == diagnostic_id)
+		{
+			count_message(Message::Diagnostic);
+			diagnostic_callback(message);
+		}
+		else
+		{
+			return false;
+		}
+		return true;
+	}
+
+	/// @brief 上位が動かすための指令か。起動の確認に使う
+	bool is_command(const u32 id) noexcept
+	{
+		return id == servo_id || id == servo_bank_id
+			|| (inject_speed_id_base <= id && id <= inject_speed_id_base + Trunk)
+			|| id == group_fire_id || id == homing_id || id == heartbeat_id;
 	}
 
 	/// @brief サーボのコールバック
-	/// @param message
+	/// @param message dlcが1なら[0]: プリセット(Index)。それ以外は[0-1]: 角度[0.1deg], [2-3]: 最大角速度[deg/s](0で制限なし), [4]: チャンネル(省略可)
 	void servo_callback(const ReceivedMessage& message) noexcept
 	{
+		auto& servo = servos[default_servo_channel];
+
+		if(message.data.dlc >= 4)
+		{
+			const u8 channel = message.data.dlc >= 5 ? (u8)message.data.buffer[4] : default_servo_channel;
+			if(channel >= ServoBank::size) return;
+
+			servos[channel].set_target(CRSLib::bit_cast<i16>(read_u16(message.data, 0)), read_u16(message.data, 2));
+			servo_settle_request = true;
+			watchdog.feed(1u << servo_watchdog_channel, HAL_GetTick());
+			return;
+		}
+		if(message.data.dlc != 1) return;
+
 		switch(static_cast<Index>(message.data.buffer[0]))
 		{
 			case TuskL:
 			{
-				__HAL_TIM_SET_COMPARE(&htim1,TIM_CHANNEL_2,1100);
+				servo.set_target_pulse(servo.get_calibration().pulse_max_us, 0);
 			}
 			break;
 
 			case TuskR:
 			{
-				__HAL_TIM_SET_COMPARE(&htim1,TIM_CHANNEL_2,390);
+				servo.set_target_pulse(servo.get_calibration().pulse_min_us, 0);
 			}
 			break;
 
 			case Trunk:
 			{
-				__HAL_TIM_SET_COMPARE(&htim1,TIM_CHANNEL_2,700);
+				servo.set_target_pulse(servo.get_calibration().pulse_center_us, 0);
 			}
+			break;
 
-			default:;
+			default:
+			return;
+		}
+		servo_settle_request = true;
+		watchdog.feed(1u << servo_watchdog_channel, HAL_GetTick());
+	}
+
+	/// @brief 全サーボ一括のコールバック。各チャンネルは直前に指定された最大角速度で動く
+	/// @param message [0-1], [2-3], [4-5], [6-7]: CH1~CH4の角度[0.1deg]。0x8000ならそのチャンネルは変更しない
+	void servo_bank_callback(const ReceivedMessage& message) noexcept
+	{
+		constexpr u16 keep = 0x80'00;
+
+		for(u8 i = 0; i < ServoBank::size && 2 * i + 1 < message.data.dlc; ++i)
+		{
+			const u16 angle = read_u16(message.data, 2 * i);
+			if(angle == keep) continue;
+
+			servos[i].set_target(CRSLib::bit_cast<i16>(angle), servos[i].get_max_speed());
 		}
+		servo_settle_request = true;
+		watchdog.feed(1u << servo_watchdog_channel, HAL_GetTick());
 	}
 
 	/// @brief インジェクターのコールバック
 	/// @param message
 	void inject_callback(const ReceivedMessage& message) noexcept
 	{
+		// 同定中は射出しない
+		if(identification.is_running()) return;
+
 		const auto which = static_cast<Index>(message.id - inject_speed_id_base);
-//		const i16 speed = (u8)message.data.buffer[0] << 8 | (u8)(message.data.buffer[1]);
-//
-//		Nhk23Servo::injectors[which].inject_start(speed);
+		watchdog.feed(1u << which, HAL_GetTick());
+
+		if constexpr(use_state_machine)
+		{
+			// [0-1]: 速度, [2]: 発数(省略時1), [3-4]: 射出間隔の下限[ms]
+			if(message.data.dlc < 2) return;
+			const i16 speed = CRSLib::bit_cast<i16>(read_u16(message.data, 0));
+			const u8 count = message.data.dlc >= 3 ? (u8)message.data.buffer[2] : 1;
+			const u16 interval_ms = message.data.dlc >= 5 ? read_u16(message.data, 3) : 0;
+
+			injectors[which].inject_burst(speed, count, interval_ms);
+		}
+		else
+		{
+//			speed = (u8)message.data.buffer[0] << 8 | (u8)(message.data.buffer[1]);
+			speed = speed_max;
+			selected_mask = 1u << which;
+			time = HAL_GetTick();
+		}
+	}
+
+	/// @brief システム同定開始のコールバック
+	/// @param message [0]: 励起信号の種類, [1]: モーター, [2-3]: 振幅, [4-5]: tick数, [6-7]: Chirpなら開始・終了周波数[Hz], PrbsならPRBSの保持tick数
+	void identification_start_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc < 8) return;
+
+		const auto excitation = static_cast<Identification::Excitation>(message.data.buffer[0]);
+		const u8 motor = (u8)message.data.buffer[1];
+		if(motor > Trunk || excitation > Identification::Excitation::Prbs) return;
+
+		Identification::Config config{};
+		config.excitation = excitation;
+		config.motor = motor;
+		config.amplitude = CRSLib::bit_cast<i16>(read_u16(message.data, 2));
+		config.length = read_u16(message.data, 4);
+		config.f_start = (u8)message.data.buffer[6];
+		config.f_end = (u8)message.data.buffer[7];
+		config.prbs_hold = (u8)message.data.buffer[6];
+
+		// 同定中は射出を止める。前の記録を読み出している途中なら、サンプルが入れ替わる前に打ち切る
+		speed = 0;
+		if(bulk_sender.is_busy() && bulk_kind == Bulk::Identification) bulk_sender.abort();
+		identification.start(config);
+	}
+
+	/// @brief 記録したサンプル読み出しのコールバック。[0-1]: サンプル番号
+	/// @param message
+	void identification_read_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc < 2) return;
+		identification_read_request = read_u16(message.data, 0);
+	}
+
+	/// @brief 同時射出のコールバック。対象が全てIdleになった制御tickで一斉に射出し、0x152で結果を返す
+	/// @param message [0]: インジェクターのビット集合(bit0: TuskL, bit1: TuskR, bit2: Trunk), [1-2]: 速度
+	void group_fire_callback(const ReceivedMessage& message) noexcept
+	{
+		if(identification.is_running() || message.data.dlc < 1) return;
+
+		const u8 mask = (u8)message.data.buffer[0] & 0b111;
+		if(mask == 0) return;
+		watchdog.feed(mask, HAL_GetTick());
+
+		if constexpr(use_state_machine)
+		{
+			if(message.data.dlc < 3) return;
+			group_fire.arm(mask, CRSLib::bit_cast<i16>(read_u16(message.data, 1)), HAL_GetTick());
+		}
+		else
+		{
+			speed = speed_max;
+			selected_mask = mask;
+			time = HAL_GetTick();
+			group_fire.fired_together(mask);
+		}
+	}
+
+	/// @brief 原点出しのコールバック。電源を入れた後は、射出の前にこれで原点出しをする
+	/// @param message [0]: インジェクターのビット集合
+	void homing_callback(const ReceivedMessage& message) noexcept
+	{
+		if constexpr(use_state_machine)
+		{
+			if(message.data.dlc < 1) return;
+
+			const u8 mask = (u8)message.data.buffer[0] & 0b111;
+			watchdog.feed(mask, HAL_GetTick());
+			for(u8 i = 0; i < injectors.size(); ++i)
+			{
+				if(mask >> i & 1u) injectors[i].start_homing();
+			}
+		}
+	}
+
+	/// @brief 詰まったときの対処の設定とFaultの解除のコールバック
+	/// @param message [0]: インジェクターのビット集合, [1]: 対処(JamRecovery。0xFFなら変更しない), [2]: 1ならFaultを解除
+	void jam_config_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc < 3) return;
+
+		const u8 mask = (u8)message.data.buffer[0];
+		const u8 recovery = (u8)message.data.buffer[1];
+		const bool clear_fault = (u8)message.data.buffer[2] == 1;
+
+		for(u8 i = 0; i < injectors.size(); ++i)
+		{
+			if(!(mask >> i & 1u)) continue;
+
+			if(recovery <= (u8)Injector::JamRecovery::Fault) injectors[i].set_jam_recovery(static_cast<Injector::JamRecovery>(recovery));
+			if(clear_fault) injectors[i].clear_fault();
+		}
+	}
+
+	/// @brief システム同定で記録したサンプルから、そのモーターのフィードフォワード係数を求めて設定する。同定中か、別のモーターの記録なら何もしない
+	void fit_feedforward(const u8 which) noexcept
+	{
+		if(identification.is_running() || identification.target_motor() != which) return;
+
+		FeedforwardFit fit{};
+		for(u16 i = 1; i + 1 < identification.size(); ++i)
+		{
+			const auto previous = *identification.get_sample(i - 1);
+			const auto sample = *identification.get_sample(i);
+			const auto next = *identification.get_sample(i + 1);
+			fit.add(previous.speed, sample.speed, next.speed, sample.command);
+		}
+		if(const auto feedforward = fit.solve(); feedforward) injectors[which].set_feedforward(*feedforward);
+	}
+
+	/// @brief フィードフォワード係数のコールバック。係数は0x15FのFeedforwardで読める
+	/// @param message [0]: インジェクター, [1]: 0なら直前のシステム同定の記録から求めて設定(メインループで求める), 1なら[2]の係数に[4-7](float)を設定
+	void feedforward_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc < 2) return;
+
+		const u8 which = (u8)message.data.buffer[0];
+		if(which > Trunk) return;
+
+		switch((u8)message.data.buffer[1])
+		{
+			case 0:
+			feedforward_fit_request = which;
+			break;
+
+			case 1:
+			{
+				const u8 coefficient = (u8)message.data.buffer[2];
+				if(message.data.dlc < 8 || coefficient >= Feedforward::N) return;
+
+				auto feedforward = injectors[which].get_feedforward();
+				feedforward[static_cast<Feedforward::Coefficient>(coefficient)] = CRSLib::bit_cast<float>((u32)read_u16(message.data, 4) << 16 | read_u16(message.data, 6));
+				injectors[which].set_feedforward(feedforward);
+			}
+			break;
+
+			default:;
+		}
+	}
+
+	/// @brief 今の値を全部保存する。書き込み中(数十us、ページを移すときは数十ms)は止まるので、どのモーターにも電流を指令していなければ保存する
+	/// @return 保存したらtrue
+	bool save_params() noexcept
+	{
+		if(!is_current_zero()) return false;
+
+		bool ok = true;
+		for(u16 key = 0; key < ParamN; ++key)
+		{
+			if(const auto value = get_live_param(key); value) ok = params.set(key, *value) && ok;
+		}
+		return ok;
+	}
+
+	/// @brief パラメータの保存と読み出しのコールバック
+	/// @param message [0]: 0なら[1]のキーの保存してある値を0x153で返す, 1なら今の値を全部保存し、0x153の[0-1]を0xFFFF、[2]を保存したら1、電流を指令中などで保存しなかったら0にして返す, [1]: キー(Param)
+	void param_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc < 1) return;
+
+		switch((u8)message.data.buffer[0])
+		{
+			case 0:
+			if(message.data.dlc < 2) return;
+			param_read_request = (u8)message.data.buffer[1];
+			break;
+
+			case 1:
+			param_save_request = true;
+			break;
+
+			default:;
+		}
+	}
+
+	/// @brief ブートローダに入るコールバック。以降の書き換えはTools/can_flash.pyで0x700+ノード番号を使う
+	/// @param message [0-3]: "BOOT"。誤って入らないよう、それ以外は無視する
+	void bootloader_callback(const ReceivedMessage& message) noexcept
+	{
+		constexpr std::array<byte, 4> key{(byte)'B', (byte)'O', (byte)'O', (byte)'T'};
+		if(message.data.dlc != key.size()) return;
+		for(u8 i = 0; i < key.size(); ++i)
+		{
+			if(message.data.buffer[i] != key[i]) return;
+		}
 
-//		speed = (u8)message.data.buffer[0] << 8 | (u8)(message.data.buffer[1]);
-		speed = speed_max;
-		selected = which;
-		time = HAL_GetTick();
+		bootloader_request = true;
+	}
+
+	/// @brief ハートビートのコールバック。指令を受けたことのあるチャンネルを全て延長する。最初のハートビートから途絶えを見始める
+	/// @param message [0-1]: 途絶えたとみなす時間[ms](省略可。0なら止めない)。0x146で保存できる
+	void heartbeat_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc >= 2) watchdog.set_timeout_ms(read_u16(message.data, 0));
+		watchdog.feed_heartbeat(HAL_GetTick());
+	}
+
+	/// @brief 分割転送のコールバック。Tools/bulk_receive.pyで受け取る
+	/// @param message [0]が0x01~0x07なら要求で[1]: 種類(Bulk), [2-5]: 始めるオフセット(省略可。途中まで受け取れたときに続きを要求する)。0x3_ならFlow Control(bulk_transfer.hpp)
+	void bulk_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc < 2) return;
+
+		const u8 pci = (u8)message.data.buffer[0];
+		if((pci & 0xF0) == 0x30)
+		{
+			bulk_sender.on_flow_control(message.data, CycleCounter::now());
+		}
+		else if(1 <= pci && pci <= 7)
+		{
+			const auto kind = static_cast<Bulk>(message.data.buffer[1]);
+			if(kind >= Bulk::N) return;
+			const u32 offset = pci >= 5 && message.data.dlc >= 6 ? (u32)read_u16(message.data, 2) << 16 | read_u16(message.data, 4) : 0;
+
+			// 新しい要求が来たら、前の転送は受信側が諦めたとみなす
+			bulk_sender.abort();
+			if(const auto source = make_bulk_source(kind); source && bulk_sender.start(*source, offset)) bulk_kind = kind;
+		}
+	}
+
+	/// @brief ブラックボックスのコールバック。止まったら0x149でBlackBoxを要求して読み出す
+	/// @param message [0]: 0なら今止める, 1なら捨てて記録し直す, 2なら[1]周期ごとに記録する
+	void black_box_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc < 1) return;
+
+		switch((u8)message.data.buffer[0])
+		{
+			case 0:
+			black_box.fire(decltype(black_box)::Trigger::Command);
+			break;
+
+			case 1:
+			// 読み出している途中なら中身が変わる前に打ち切る
+			if(bulk_sender.is_busy() && bulk_kind == Bulk::BlackBox) bulk_sender.abort();
+			black_box.rearm();
+			break;
+
+			case 2:
+			if(message.data.dlc < 2) return;
+			black_box.set_decimation((u8)message.data.buffer[1]);
+			break;
+
+			default:;
+		}
+	}
+
+	/// @brief 指令が途絶えたチャンネルを止める。電流はwatchdog.clampで0まで下げる
+	void stop_expired(const u16 expired_mask) noexcept
+	{
+		for(u8 i = 0; i < injectors.size(); ++i)
+		{
+			if(expired_mask >> i & 1u) injectors[i].stop();
+		}
+
+		black_box.fire(decltype(black_box)::Trigger::Watchdog);
+
+		if(expired_mask >> servo_watchdog_channel & 1u)
+		{
+			for(u8 i = 0; i < ServoBank::size; ++i)
+			{
+				servos[i].set_target_pulse(servos[i].get_calibration().pulse_center_us, 0);
+			}
+		}
+	}
+
+	/// @brief 診断情報要求のコールバック
+	/// @param message [0]: 種類(Diagnostic), [1]: インジェクターなどの番号, [2]: 種類ごとの副番号
+	void diagnostic_callback(const ReceivedMessage& message) noexcept
+	{
+		if(message.data.dlc < 1) return;
+
+		const auto kind = static_cast<Diagnostic>(message.data.buffer[0]);
+		if(kind >= Diagnostic::N) return;
+
+		const u8 index = message.data.dlc >= 2 ? (u8)message.data.buffer[1] : 0;
+		const u8 sub_index = message.data.dlc >= 3 ? (u8)message.data.buffer[2] : 0;
+		diagnostic_request = DiagnosticRequest{.kind=kind, .index=index, .sub_index=sub_index};
+	}
+
+	/// @brief 診断情報を0x15Fで送信する
+	void post_diagnostic(Bus& can_bus, const DiagnosticRequest& request) noexcept
+	{
+		CRSLib::Can::DataField data{.buffer={}, .dlc=8};
+		data.buffer[0] = (byte)request.kind;
+		data.buffer[1] = (byte)request.index;
+
+		switch(request.kind)
+		{
+			case Diagnostic::ShotCounter:
+			{
+				if(request.index > Trunk) return;
+
+				const auto& counter = injectors[request.index].get_shot_counter();
+				write_i16(data, 2, counter.queued);
+				write_i16(data, 4, counter.fired);
+				write_i16(data, 6, counter.dropped);
+			}
+			break;
+
+			case Diagnostic::Thermal:
+			{
+				if(request.index > Trunk) return;
+
+				const auto& limiter = thermal_limiters[request.index];
+				write_i16(data, 2, limiter.get_limit());
+				data.buffer[4] = (byte)motor_states[request.index].feedback.temperature;
+				data.buffer[5] = (byte)limiter.get_heat_percent();
+				data.dlc = 6;
+			}
+			break;
+
+			case Diagnostic::Cycles:
+			{
+				const std::array<CycleStats*, 4> all{&control_cycles, &receive_cycles, &driver_receive_cycles, &driver_post_cycles};
+				if(request.index >= all.size()) return;
 
+				auto& stats = *all[request.index];
+				write_i16(data, 2, std::min<u32>(stats.count == 0 ? 0 : stats.min, 0xFF'FF));
+				write_i16(data, 4, std::min<u32>(stats.max, 0xFF'FF));
+				write_i16(data, 6, std::min<u32>(stats.mean(), 0xFF'FF));
+				stats.reset();
+			}
+			break;
+
+			case Diagnostic::Feedforward:
+			{
+				if(request.index > Trunk || request.sub_index >= Feedforward::N) return;
+
+				auto feedforward = injectors[request.index].get_feedforward();
+				const u32 value = CRSLib::bit_cast<u32>(feedforward[static_cast<Feedforward::Coefficient>(request.sub_index)]);
+				data.buffer[2] = (byte)request.sub_index;
+				write_i16(data, 4, value >> 16);
+				write_i16(data, 6, value & 0xFF'FF);
+			}
+			break;
+
+			case Diagnostic::Boot:
+			{
+				if(request.index >= BootTiming::N) return;
+
+				const auto mark = static_cast<BootTiming::Mark>(request.index);
+				const u32 us = boot_timing.get_us(mark);
+				data.buffer[2] = (byte)boot_timing.is_marked(mark);
+				write_i16(data, 4, us >> 16);
+				write_i16(data, 6, us & 0xFF'FF);
+			}
+			break;
+
+			case Diagnostic::StateStats:
+			{
+				if(request.index > Trunk || request.sub_index >= (u8)Injector::ControlState::N) return;
+
+				const auto& injector = injectors[request.index];
+				const auto& stats = injector.get_state_stats(static_cast<Injector::ControlState>(request.sub_index));
+				data.buffer[2] = (byte)request.sub_index;
+				data.buffer[3] = (byte)injector.get_control_state();
+				write_i16(data, 4, stats.entries);
+				write_i16(data, 6, std::min<u32>(stats.max_cycles, 0xFF'FF));
+			}
+			break;
+
+			case Diagnostic::Watchdog:
+			{
+				write_i16(data, 2, std::min<u32>(watchdog.get_timeout_ms(), 0xFF'FF));
+				write_i16(data, 4, watchdog.get_expired_count());
+				data.buffer[6] = (byte)watchdog.get_expired_mask();
+				data.dlc = 7;
+			}
+			break;
+
+			case Diagnostic::BlackBox:
+			{
+				data.buffer[1] = (byte)black_box.get_decimation();
+				data.buffer[2] = (byte)black_box.get_trigger();
+				data.buffer[3] = (byte)black_box.is_frozen();
+				write_i16(data, 4, black_box.size());
+				write_i16(data, 6, black_box.get_trigger_index());
+			}
+			break;
+
+			case Diagnostic::Jitter:
+			{
+				const std::array<LogHistogram<>*, 2> all{&loop_period_us, &control_interval_us};
+				if(request.index >= all.size()) return;
+
+				auto& histogram = *all[request.index];
+				write_i16(data, 2, std::min<u32>(histogram.percentile(500), 0xFF'FF));
+				write_i16(data, 4, std::min<u32>(histogram.percentile(990), 0xFF'FF));
+				write_i16(data, 6, std::min<u32>(histogram.get_max(), 0xFF'FF));
+				histogram.reset();
+			}
+			break;
+
+			case Diagnostic::CanFifo:
+			{
+				if(request.index >= fifo_counters.size()) return;
+
+				const auto& counters = fifo_counters[request.index];
+				write_i16(data, 2, counters.received & 0xFF'FF);
+				write_i16(data, 4, counters.dropped() & 0xFF'FF);
+				data.buffer[6] = (byte)std::min<u32>(counters.overruns, 0xFF);
+				data.buffer[7] = (byte)std::min<u32>(counters.fulls, 0xFF);
+			}
+			break;
+
+			case Diagnostic::MessageCount:
+			{
+				if(request.index >= message_counts.size()) return;
+
+				write_u32(data, 4, message_counts[request.index]);
+			}
+			break;
+
+			case Diagnostic::FeedbackRate:
+			{
+				if(request.index > Trunk) return;
+
+				write_i16(data, 2, feedback_rate.get_rate(request.index));
+				write_u32(data, 4, feedback_rate.get_count(request.index));
+			}
+			break;
+
+			case Diagnostic::Jam:
+			{
+				if(request.index > Trunk) return;
+
+				const auto& counter = injectors[request.index].get_jam_counter();
+				write_i16(data, 2, counter.jams);
+				write_i16(data, 4, counter.retries);
+				write_i16(data, 6, counter.faults);
+			}
+			break;
+
+			default:
+			return;
+		}
+
+		(void)can_bus.post(diagnostic_reply_id, data);
 	}
 
 	/// @brief fifo1のコールバック
 	/// @param message
-	void fifo1_callback(const ReceivedMessage& message) noexcept
+	bool fifo1_callback(const ReceivedMessage& message) noexcept
 	{
-		if(0x201 <= message.id && message.id <= 0x203)
+		if(motor_state_id_base <= message.id && message.id <= motor_state_id_base + Trunk)
 		{
+			count_message(Message::MotorState);
 			motor_state_callback(message);
+			return true;
 		}
+		return false;
 	}
 
 	/// @brief モーターの状態のコールバック
 	/// @param message
 	void motor_state_callback(const ReceivedMessage& message) noexcept
 	{
+		// C620は常に8byte送る。欠けたフレームで状態を壊さない
+		if(message.data.dlc != 8) return;
+
 		const auto which = static_cast<Index>(message.id - motor_state_id_base);
+		feedback_rate.count(which);
 
 		Feedback feedback{};
 		feedback.angle = (u32)message.data.buffer[0] << 8 | (u32)(message.data.buffer[1]);
 		feedback.speed = CRSLib::bit_cast<i16>((u16)((u32)message.data.buffer[2] << 8 | (u32)(message.data.buffer[3])));
 		feedback.current = CRSLib::bit_cast<i16>((u16)((u32)message.data.buffer[4] << 8 | (u32)(message.data.buffer[5])));
+		feedback.temperature = (u8)message.data.buffer[6];
 
-//		injectors[which].update_motor_state(feedback);
+		const u32 now = HAL_GetTick();
+		motor_states[which].update(feedback, now);
+		injectors[which].update_motor_state(feedback, now);
+
+		if constexpr(use_state_machine)
+		{
+			BackupDomain::save_position(which, injectors[which].fixed_position());
+		}
 	}
 }
@@ -0,0 +1,187 @@
+#include "host.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include "tim.h"
+#include "can.h"
+
+CAN_TypeDef host_can1{};
+TIM_TypeDef host_tim1{};
+BKP_TypeDef host_bkp{};
+RCC_TypeDef host_rcc{};
+DWT_Type host_dwt{};
+CoreDebug_Type host_core_debug{};
+SCB_Type host_scb{};
+IWDG_TypeDef host_iwdg{};
+
+TIM_HandleTypeDef htim1 = []() noexcept
+{
+	TIM_HandleTypeDef ret{};
+	ret.Instance = TIM1;
+	return ret;
+}();
+CAN_HandleTypeDef hcan = []() noexcept
+{
+	CAN_HandleTypeDef ret{};
+	ret.Instance = CAN1;
+	return ret;
+}();
+
+namespace Host
+{
+	u32 tick{0};
+	std::function<void()> on_get_tick{};
+	std::function<void()> on_reset{};
+
+	namespace
+	{
+		u32 flash_erase_count{0};
+		u32 flash_program_count{0};
+		bool flash_locked{true};
+
+		volatile u8 * map_flash() noexcept
+		{
+			void *const address = ::mmap(reinterpret_cast<void *>(flash_address), flash_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+			if(address != reinterpret_cast<void *>(flash_address))
+			{
+				std::fprintf(stderr, "host: cannot map the flash at 0x%08X\n", static_cast<unsigned>(flash_address));
+				std::abort();
+			}
+			std::memset(address, 0xFF, flash_size);
+			return static_cast<volatile u8 *>(address);
+		}
+
+		volatile u8 *const flash = map_flash();
+
+		// 0xFFFFのハーフワードにしか書けない(0を書くのだけは許す)のはF1と同じ
+		HAL_StatusTypeDef program_halfword(const u32 address, const u16 data) noexcept
+		{
+			if(flash_locked || address % 2 != 0 || address < flash_address || address + 2 > flash_address + flash_size) return HAL_ERROR;
+
+			volatile u16& cell = *reinterpret_cast<volatile u16 *>(flash + (address - flash_address));
+			if(cell != 0xFF'FF && data != 0) return HAL_ERROR;
+			cell = data;
+			return HAL_OK;
+		}
+	}
+
+	void erase_flash() noexcept
+	{
+		std::memset(const_cast<u8 *>(flash), 0xFF, flash_size);
+		flash_erase_count = 0;
+		flash_program_count = 0;
+	}
+
+	u32 get_flash_erase_count() noexcept
+	{
+		return flash_erase_count;
+	}
+
+	u32 get_flash_program_count() noexcept
+	{
+		return flash_program_count;
+	}
+
+	void reset_peripherals() noexcept
+	{
+		// 読み出し専用のレジスタがあって代入できないので、memsetで消す
+		std::memset(static_cast<void *>(&host_can1), 0, sizeof(host_can1));
+		std::memset(static_cast<void *>(&host_tim1), 0, sizeof(host_tim1));
+		std::memset(static_cast<void *>(&host_bkp), 0, sizeof(host_bkp));
+		std::memset(static_cast<void *>(&host_rcc), 0, sizeof(host_rcc));
+		std::memset(static_cast<void *>(&host_dwt), 0, sizeof(host_dwt));
+		std::memset(static_cast<void *>(&host_core_debug), 0, sizeof(host_core_debug));
+		std::memset(static_cast<void *>(&host_scb), 0, sizeof(host_scb));
+		std::memset(static_cast<void *>(&host_iwdg), 0, sizeof(host_iwdg));
+	}
+}
+
+extern "C"
+{
+	uint32_t HAL_GetTick(void)
+	{
+		// on_get_tickの中でHAL_GetTick()を呼んでも繰り返さない
+		static bool calling = false;
+		if(Host::on_get_tick && !calling)
+		{
+			calling = true;
+			Host::on_get_tick();
+			calling = false;
+		}
+		return Host::tick;
+	}
+
+	void HAL_Delay(const uint32_t delay)
+	{
+		Host::tick += delay;
+	}
+
+	HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+	{
+		Host::flash_locked = false;
+		return HAL_OK;
+	}
+
+	HAL_StatusTypeDef HAL_FLASH_Lock(void)
+	{
+		Host::flash_locked = true;
+		return HAL_OK;
+	}
+
+	HAL_StatusTypeDef HAL_FLASH_Program(const uint32_t type_program, const uint32_t address, const uint64_t data)
+	{
+		const int halfwords = type_program == FLASH_TYPEPROGRAM_HALFWORD ? 1 : type_program == FLASH_TYPEPROGRAM_WORD ? 2 : 4;
+		++Host::flash_program_count;
+		for(int i = 0; i < halfwords; ++i)
+		{
+			if(Host::program_halfword(address + 2 * i, static_cast<uint16_t>(data >> (16 * i))) != HAL_OK) return HAL_ERROR;
+		}
+		return HAL_OK;
+	}
+
+	HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *const erase, uint32_t *const page_error)
+	{
+		*page_error = 0xFFFF'FFFF;
+		if(Host::flash_locked) return HAL_ERROR;
+
+		constexpr uint32_t page_size = 0x400;
+		for(uint32_t i = 0; i < erase->NbPages; ++i)
+		{
+			const uint32_t address = erase->PageAddress + page_size * i;
+			if(address < Host::flash_address || address + page_size > Host::flash_address + Host::flash_size)
+			{
+				*page_error = address;
+				return HAL_ERROR;
+			}
+			std::memset(const_cast<uint8_t *>(Host::flash) + (address - Host::flash_address), 0xFF, page_size);
+			++Host::flash_erase_count;
+		}
+		return HAL_OK;
+	}
+
+	HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *const htim, const uint32_t channel)
+	{
+		htim->Instance->CCER = htim->Instance->CCER | (TIM_CCx_ENABLE << (channel & 0x1FU));
+		htim->Instance->CR1 = htim->Instance->CR1 | TIM_CR1_CEN;
+		return HAL_OK;
+	}
+
+	void HAL_PWR_EnableBkUpAccess(void)
+	{}
+
+	void Error_Handler(void)
+	{
+		std::fprintf(stderr, "Error_Handler\n");
+		std::abort();
+	}
+
+	void host_system_reset(void)
+	{
+		if(Host::on_reset) Host::on_reset();
+		std::abort();
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <functional>
+
+#include "main.h"
+
+#include <CRSLibtmp/std_type.hpp>
+
+// ホストでファームウェアのコードを動かすための、HALと周辺機能の置き換え
+namespace Host
+{
+	using namespace CRSLib::IntegerTypes;
+
+	// HAL_GetTick()の値[ms]。テストが進める
+	extern u32 tick;
+	// HAL_GetTick()のたびに呼ぶ。終わらないメインループを外から進める用
+	extern std::function<void()> on_get_tick;
+	// NVIC_SystemReset()で呼ぶ。戻ってきたらabortする
+	extern std::function<void()> on_reset;
+
+	// フラッシュ(0x0800'0000から64KB)を固定アドレスに割り当ててある。ParamStoreなどはそのまま読める
+	constexpr u32 flash_address = 0x0800'0000;
+	constexpr u32 flash_size = 64 * 1024;
+
+	/// @brief フラッシュを全て消去した状態(0xFF)に戻し、数えた回数も0に戻す
+	void erase_flash() noexcept;
+	// HAL_FLASHEx_Eraseで消したページ数
+	u32 get_flash_erase_count() noexcept;
+	// HAL_FLASH_Programで書いた回数
+	u32 get_flash_program_count() noexcept;
+
+	/// @brief 周辺機能のレジスタを全て0に戻す
+	void reset_peripherals() noexcept;
+}
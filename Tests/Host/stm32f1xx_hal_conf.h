@@ -0,0 +1,40 @@
+#ifndef NHK23_SERVO_HOST_HAL_CONF_H
+#define NHK23_SERVO_HOST_HAL_CONF_H
+
+// ホストでのテスト用。Core/Incの設定を読んだ後、周辺機能のレジスタをホストのメモリへ向け直す。
+// HALの関数はhost.cppで置き換える
+
+#include_next "stm32f1xx_hal_conf.h"
+
+extern CAN_TypeDef host_can1;
+extern TIM_TypeDef host_tim1;
+extern BKP_TypeDef host_bkp;
+extern RCC_TypeDef host_rcc;
+extern DWT_Type host_dwt;
+extern CoreDebug_Type host_core_debug;
+extern SCB_Type host_scb;
+extern IWDG_TypeDef host_iwdg;
+
+#undef CAN1
+#define CAN1 (&host_can1)
+#undef TIM1
+#define TIM1 (&host_tim1)
+#undef BKP
+#define BKP (&host_bkp)
+#undef RCC
+#define RCC (&host_rcc)
+#undef DWT
+#define DWT (&host_dwt)
+#undef CoreDebug
+#define CoreDebug (&host_core_debug)
+#undef SCB
+#define SCB (&host_scb)
+#undef IWDG
+#define IWDG (&host_iwdg)
+
+// リセットはhost.cppのフックを呼んでから終了する
+void host_system_reset(void) __attribute__((noreturn));
+#undef NVIC_SystemReset
+#define NVIC_SystemReset host_system_reset
+
+#endif
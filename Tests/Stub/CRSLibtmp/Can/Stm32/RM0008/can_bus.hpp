@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <optional>
+
+#include <CRSLibtmp/std_type.hpp>
+
+namespace CRSLib::Can
+{
+	struct DataField final
+	{
+		std::array<IntegerTypes::byte, 8> buffer;
+		IntegerTypes::u8 dlc;
+	};
+}
+
+namespace CRSLib::Can::Stm32::RM0008
+{
+	using namespace CRSLib::IntegerTypes;
+
+	enum class Fifo : u8
+	{
+		Fifo0,
+		Fifo1
+	};
+
+	struct ReceivedMessage final
+	{
+		u32 id;
+		DataField data;
+	};
+
+	struct CanX final
+	{};
+	inline CanX can1{};
+
+	/// @brief 初期化だけをする。送受信はCanFastでbxCANのレジスタ(ホストではHost::can1)を読み書きする
+	class CanBus final
+	{
+		public:
+		CanBus(CanX&) noexcept
+		{}
+
+		std::optional<ReceivedMessage> receive(Fifo) noexcept
+		{
+			return std::nullopt;
+		}
+
+		bool post(u32, const DataField&) noexcept
+		{
+			return false;
+		}
+	};
+}
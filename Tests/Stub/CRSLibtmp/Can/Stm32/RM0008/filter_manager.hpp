@@ -0,0 +1,52 @@
+#pragma once
+
+#include <CRSLibtmp/std_type.hpp>
+#include "can_bus.hpp"
+
+namespace CRSLib::Can::Stm32::RM0008
+{
+	using namespace CRSLib::IntegerTypes;
+
+	inline constexpr u8 filter_bank_size = 14;
+
+	struct FilterConfig final
+	{
+		Fifo fifo{Fifo::Fifo0};
+
+		static FilterConfig make_default(const Fifo fifo, const bool = true) noexcept
+		{
+			return FilterConfig{.fifo=fifo};
+		}
+	};
+
+	struct Filter final
+	{
+		u32 FR1;
+		u32 FR2;
+	};
+
+	/// @brief フィルタは設定しない。ホストではテストが受信FIFOを直接選ぶ
+	struct FilterManager final
+	{
+		static void initialize(u8, const FilterConfig *) noexcept
+		{}
+
+		static bool set_filter(u8, const Filter&) noexcept
+		{
+			return true;
+		}
+
+		static void activate(u8) noexcept
+		{}
+
+		static u32 make_list32(const u32 id) noexcept
+		{
+			return id << 21;
+		}
+
+		static Filter make_mask32(const u32 id, const u32 mask) noexcept
+		{
+			return Filter{.FR1=id << 21, .FR2=mask << 21};
+		}
+	};
+}
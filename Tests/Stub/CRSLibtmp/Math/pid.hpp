@@ -0,0 +1,24 @@
+#pragma once
+
+namespace CRSLib::Math
+{
+	/// @brief 位置形のPID。updateは制御周期ごとに1回呼ぶ
+	template<class T>
+	struct Pid final
+	{
+		T p;
+		T i;
+		T d;
+		T sum{0};
+		T last_error{0};
+
+		T update(const T target, const T current) noexcept
+		{
+			const T error = target - current;
+			sum += error;
+			const T ret = p * error + i * sum + d * (error - last_error);
+			last_error = error;
+			return ret;
+		}
+	};
+}
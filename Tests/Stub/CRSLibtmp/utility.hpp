@@ -0,0 +1,8 @@
+#pragma once
+
+#include <bit>
+
+namespace CRSLib
+{
+	using std::bit_cast;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// feedback.hpp は大文字小文字の違うパスで読む
+#include <CRSLibtmp/std_type.hpp>
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+
+// 失敗しても続けて全て調べ、最後にresult()を終了コードにする
+namespace Test
+{
+	inline int failures = 0;
+
+	inline bool check(const bool ok, const char *const expression, const char *const file, const int line) noexcept
+	{
+		if(!ok)
+		{
+			++failures;
+			std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expression);
+		}
+		return ok;
+	}
+
+	inline int result() noexcept
+	{
+		if(failures != 0) std::fprintf(stderr, "%d check(s) failed\n", failures);
+		return failures == 0 ? 0 : 1;
+	}
+}
+
+#define CHECK(expression) Test::check(static_cast<bool>(expression), #expression, __FILE__, __LINE__)
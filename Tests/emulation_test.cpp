@@ -0,0 +1,315 @@
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "check.hpp"
+#include "host.hpp"
+
+#include <CRSLibtmp/std_type.hpp>
+#include "boot_layout.hpp"
+#include "servo_timebase.hpp"
+
+// wrapper.cppのmain_cpp()をそのまま動かし、bxCANとTIM1のレジスタを外から読み書きして確かめる
+extern "C" void main_cpp();
+
+using namespace CRSLib::IntegerTypes;
+using Nhk23Servo::ServoTimebase;
+
+namespace
+{
+	struct Frame final
+	{
+		u32 id;
+		std::vector<u8> data;
+	};
+
+	struct SentFrame final
+	{
+		u32 ms;
+		Frame frame;
+	};
+
+	/// @brief bxCANとTIM1の振る舞い。Host::on_get_tickから呼ぶ
+	/// @details メインループ1周(IWDGの更新)を1msとする。受信FIFOは1段で、空いていれば次のフレームを置く。
+	/// 送信は次のHAL_GetTick()でバスに出たものとするので、間にHAL_GetTick()を挟まずに2回送ると先のフレームは上書きされる
+	class Emulator final
+	{
+		std::array<std::deque<Frame>, 2> inbox{};
+		// 時刻順。同じ時刻なら足した順
+		std::multimap<u32, std::function<void()>> script{};
+
+		public:
+		std::vector<SentFrame> sent{};
+
+		void at(const u32 ms, std::function<void()> action)
+		{
+			script.emplace(ms, std::move(action));
+		}
+
+		void send(const u8 fifo, const Frame& frame)
+		{
+			inbox[fifo].push_back(frame);
+		}
+
+		/// @brief msから後に送ったフレームのうち、idのもの
+		std::vector<SentFrame> sent_since(const u32 ms, const u32 id) const
+		{
+			std::vector<SentFrame> ret{};
+			for(const auto& sent_frame : sent)
+			{
+				if(sent_frame.ms >= ms && sent_frame.frame.id == id) ret.push_back(sent_frame);
+			}
+			return ret;
+		}
+
+		void step()
+		{
+			if(host_iwdg.KR == Nhk23Servo::Boot::watchdog_key_reload)
+			{
+				host_iwdg.KR = 0;
+				++Host::tick;
+				if(Host::tick % ServoTimebase::frame_ms == 0) host_tim1.SR = host_tim1.SR | TIM_SR_UIF;
+			}
+
+			transmit();
+			for(u8 fifo = 0; fifo < 2; ++fifo) deliver(fifo);
+
+			while(!script.empty() && script.begin()->first <= Host::tick)
+			{
+				const auto action = std::move(script.begin()->second);
+				script.erase(script.begin());
+				action();
+			}
+		}
+
+		private:
+		void transmit()
+		{
+			for(auto& mailbox : host_can1.sTxMailBox)
+			{
+				if((mailbox.TIR & CAN_TI0R_TXRQ) == 0) continue;
+
+				Frame frame{.id=mailbox.TIR >> CAN_TI0R_STID_Pos, .data{}};
+				for(u32 i = 0; i < (mailbox.TDTR & CAN_TDT0R_DLC) && i < 8; ++i)
+				{
+					frame.data.push_back(static_cast<u8>((i < 4 ? mailbox.TDLR : mailbox.TDHR) >> (8 * (i % 4))));
+				}
+				sent.push_back(SentFrame{.ms=Host::tick, .frame=frame});
+				mailbox.TIR = 0;
+			}
+			// 全て空いていて、CODEは0
+			host_can1.TSR = CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2;
+		}
+
+		void deliver(const u8 fifo)
+		{
+			volatile u32& rfr = fifo == 0 ? host_can1.RF0R : host_can1.RF1R;
+			if((rfr & CAN_RF0R_FMP0) != 0 || inbox[fifo].empty()) return;
+
+			const Frame frame = inbox[fifo].front();
+			inbox[fifo].pop_front();
+
+			auto& mailbox = host_can1.sFIFOMailBox[fifo];
+			u32 rdlr = 0;
+			u32 rdhr = 0;
+			for(std::size_t i = 0; i < frame.data.size(); ++i)
+			{
+				(i < 4 ? rdlr : rdhr) |= static_cast<u32>(frame.data[i]) << (8 * (i % 4));
+			}
+			mailbox.RIR = frame.id << CAN_RI0R_STID_Pos;
+			mailbox.RDTR = frame.data.size();
+			mailbox.RDLR = rdlr;
+			mailbox.RDHR = rdhr;
+			rfr = 1;
+		}
+	};
+
+	Emulator emulator{};
+
+	u8 high(const i32 value)
+	{
+		return static_cast<u8>(value >> 8);
+	}
+
+	u8 low(const i32 value)
+	{
+		return static_cast<u8>(value);
+	}
+
+	i16 read_i16(const std::vector<u8>& data, const std::size_t offset)
+	{
+		return static_cast<i16>(data[offset] << 8 | data[offset + 1]);
+	}
+
+	u32 compare(const u8 channel)
+	{
+		const std::array<u32, 4> ccr{host_tim1.CCR1, host_tim1.CCR2, host_tim1.CCR3, host_tim1.CCR4};
+		return ccr[channel];
+	}
+
+	const Nhk23Servo::Boot::Trailer& trailer()
+	{
+		return *reinterpret_cast<const Nhk23Servo::Boot::Trailer *>(Nhk23Servo::Boot::trailer_address(Nhk23Servo::Boot::slots[0]));
+	}
+
+	/// @brief スロットAから、確認されていないイメージとして起動したことにする
+	void install_unconfirmed_image()
+	{
+		host_scb.VTOR = Nhk23Servo::Boot::slots[0].address;
+		const Nhk23Servo::Boot::Trailer image
+		{
+			.magic=Nhk23Servo::Boot::trailer_magic,
+			.size=0x1000,
+			.crc=0,
+			.sequence=1,
+			.confirmed=Nhk23Servo::Boot::flag_clear,
+			.rejected=Nhk23Servo::Boot::flag_clear,
+			.reserved=0xFF'FF
+		};
+		std::memcpy(reinterpret_cast<void *>(Nhk23Servo::Boot::trailer_address(Nhk23Servo::Boot::slots[0])), &image, sizeof(image));
+	}
+
+	// 既定のサーボ(CH2)の正面のパルス幅[us]と、1degあたり[us]。ServoCalibrationの既定値
+	constexpr float pulse_center_us = 1410.0f;
+	constexpr float us_per_degree = 10.0f;
+	constexpr u8 servo_channel = 1;
+	constexpr u32 heartbeat_start_ms = 1'000;
+	constexpr u32 heartbeat_end_ms = 1'200;
+	constexpr u32 end_ms = 1'500;
+
+	void write_script()
+	{
+		// C620のフィードバック(1kHz)は最後まで流す。上位のハートビートはheartbeat_start_msからheartbeat_end_msの前まで
+		for(u32 ms = 1; ms < end_ms; ++ms)
+		{
+			emulator.at(ms, []{ emulator.send(1, Frame{.id=0x201, .data{0, 0, 0, 0, 0, 0, 30, 0}}); });
+			if(heartbeat_start_ms <= ms && ms < heartbeat_end_ms && ms % 50 == 0) emulator.at(ms, []{ emulator.send(0, Frame{.id=0x148, .data{}}); });
+		}
+
+		// 起動後のTIM1。タイムベースはServoTimebaseの値で、4チャンネルとも出力している
+		emulator.at(5, []
+		{
+			CHECK(host_tim1.PSC == ServoTimebase::prescaler);
+			CHECK(host_tim1.ARR == ServoTimebase::period);
+			CHECK((host_tim1.CR1 & TIM_CR1_CEN) != 0);
+			CHECK((host_tim1.CCER & (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E)) == (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E));
+			// フィードバックだけでは起動を確認しない
+			CHECK(trailer().confirmed == Nhk23Servo::Boot::flag_clear);
+
+			// 30degへ、角速度の制限なし
+			emulator.send(0, Frame{.id=0x110, .data{high(300), low(300), 0, 0}});
+		});
+
+		// 初回の指令はそのまま比較値になる。指令を受けたので起動を確認する
+		emulator.at(20, []
+		{
+			CHECK(compare(servo_channel) == ServoTimebase::us_to_ticks(pulse_center_us + 30 * us_per_degree));
+			CHECK(trailer().confirmed == Nhk23Servo::Boot::flag_set);
+			CHECK(emulator.sent_since(0, 0x151).size() == 1);
+
+			// -30degへ100deg/sで。60degなので600ms
+			emulator.send(0, Frame{.id=0x110, .data{high(-300), low(-300), 0, 100}});
+		});
+
+		emulator.at(40, []
+		{
+			// 推定整定時間はceil(60deg / 100deg/s)にPWMの1周期を足したもの
+			const auto settle = emulator.sent_since(20, 0x151);
+			if(CHECK(settle.size() == 1) && CHECK(settle[0].frame.data.size() == 2))
+			{
+				CHECK(read_i16(settle[0].frame.data, 0) == 600 + static_cast<i32>(ServoTimebase::frame_ms));
+			}
+		});
+
+		// PWMの更新ごとに少しずつ動く
+		emulator.at(320, []
+		{
+			CHECK(compare(servo_channel) < ServoTimebase::us_to_ticks(pulse_center_us + 30 * us_per_degree));
+			CHECK(compare(servo_channel) > ServoTimebase::us_to_ticks(pulse_center_us - 30 * us_per_degree));
+		});
+
+		// ハートビートを受けるまでは、指令の合間が200msを超えても正面へ戻さない
+		emulator.at(700, []
+		{
+			CHECK(compare(servo_channel) == ServoTimebase::us_to_ticks(pulse_center_us - 30 * us_per_degree));
+			// TuskLの射出
+			emulator.send(0, Frame{.id=0x120, .data{0, 0}});
+		});
+
+		// 射出中はTuskLにだけ電流を流し、duration(100ms)が過ぎたら0を送って止める
+		emulator.at(900, []
+		{
+			const auto currents = emulator.sent_since(700, 0x200);
+			std::size_t driving = 0;
+			std::optional<u32> stopped_ms{};
+			for(const auto& current : currents)
+			{
+				CHECK(current.frame.data.size() == 8);
+				const bool zero = read_i16(current.frame.data, 0) == 0;
+				CHECK(read_i16(current.frame.data, 2) == 0);
+				CHECK(read_i16(current.frame.data, 4) == 0);
+				if(!zero)
+				{
+					CHECK(!stopped_ms);
+					CHECK(read_i16(current.frame.data, 0) > 0);
+					++driving;
+				}
+				else if(!stopped_ms)
+				{
+					stopped_ms = current.ms;
+				}
+			}
+			CHECK(driving > 0);
+			if(CHECK(stopped_ms) && CHECK(!currents.empty()))
+			{
+				CHECK(*stopped_ms - currents.front().ms >= 100);
+				CHECK(*stopped_ms - currents.front().ms <= 110);
+			}
+		});
+
+		// フィードバックの受信レート。最初の1秒が過ぎてから求まる
+		emulator.at(1'100, []
+		{
+			emulator.send(0, Frame{.id=0x14F, .data{12, 0}});
+		});
+
+		emulator.at(1'120, []
+		{
+			const auto replies = emulator.sent_since(1'100, 0x15F);
+			if(CHECK(replies.size() == 1) && CHECK(replies[0].frame.data.size() == 8))
+			{
+				CHECK(replies[0].frame.data[0] == 12);
+				const i16 rate = read_i16(replies[0].frame.data, 2);
+				CHECK(990 <= rate && rate <= 1010);
+			}
+		});
+
+		// ハートビートが続いている間は正面へ戻らない
+		emulator.at(heartbeat_end_ms + 100, []
+		{
+			CHECK(compare(servo_channel) == ServoTimebase::us_to_ticks(pulse_center_us - 30 * us_per_degree));
+		});
+
+		// 最後のハートビートから200ms過ぎれば正面へ戻す
+		emulator.at(end_ms, []
+		{
+			CHECK(compare(servo_channel) == ServoTimebase::us_to_ticks(pulse_center_us));
+			std::exit(Test::result());
+		});
+	}
+}
+
+int main()
+{
+	Host::reset_peripherals();
+	install_unconfirmed_image();
+	write_script();
+	Host::on_get_tick = []{ emulator.step(); };
+
+	main_cpp();
+	return 1;
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "host.hpp"
+
+#include <CRSLibtmp/std_type.hpp>
+#include <CRSLibtmp/Can/Stm32/RM0008/can_bus.hpp>
+#include "bulk_transfer.hpp"
+#include "identification.hpp"
+#include "motor_state.hpp"
+
+// wrapper.cppの受信コールバックに任意のフレームを渡す。clangなら-fsanitize=fuzzerでlibFuzzerから、それ以外は下のmain()から呼ぶ
+// 状態は入力をまたいで残る。実機でも前のフレームの影響は残るので消さない
+
+using namespace CRSLib::IntegerTypes;
+using namespace CRSLib::Can::Stm32::RM0008;
+
+namespace Nhk23Servo
+{
+	bool fifo0_callback(const ReceivedMessage& message) noexcept;
+	bool fifo1_callback(const ReceivedMessage& message) noexcept;
+
+	// 受信処理で受けた要求を、メインループと同じように片付けるのに使う
+	extern std::array<MotorState, 3> motor_states;
+	extern Identification identification;
+	extern std::optional<u16> identification_read_request;
+	extern std::optional<u8> feedforward_fit_request;
+	void fit_feedforward(u8 which) noexcept;
+	extern bool param_save_request;
+	bool save_params() noexcept;
+	extern BulkSender bulk_sender;
+}
+
+namespace
+{
+	// 入力の[0]で選ぶID。0x201~0x203はFIFO1、それ以外はFIFO0に振り分けられる(init_can_other)。最後はどのフィルタにも当たらないID
+	constexpr std::array<u32, 22> ids
+	{
+		0x110, 0x111,
+		0x120, 0x121, 0x122,
+		0x140, 0x141, 0x142, 0x143, 0x144, 0x145, 0x146, 0x147, 0x148, 0x149, 0x14A, 0x14F,
+		0x201, 0x202, 0x203,
+		0x130, 0x7FF
+	};
+
+	/// @brief メインループのうち、受信処理が残した要求を片付ける部分
+	void run_main_loop(const u32 now) noexcept
+	{
+		if(Nhk23Servo::identification.is_running())
+		{
+			const u8 motor = Nhk23Servo::identification.target_motor();
+			(void)Nhk23Servo::identification.run_and_calc_target(Nhk23Servo::motor_states[motor].feedback, [](const i16 command) noexcept
+			{
+				return command;
+			});
+		}
+
+		if(const auto index = Nhk23Servo::identification_read_request; index)
+		{
+			Nhk23Servo::identification_read_request.reset();
+			(void)Nhk23Servo::identification.get_sample(*index);
+		}
+
+		if(const auto which = Nhk23Servo::feedforward_fit_request; which)
+		{
+			Nhk23Servo::feedforward_fit_request.reset();
+			Nhk23Servo::fit_feedforward(*which);
+		}
+
+		if(Nhk23Servo::param_save_request)
+		{
+			Nhk23Servo::param_save_request = false;
+			(void)Nhk23Servo::save_params();
+		}
+
+		if(Nhk23Servo::bulk_sender.is_busy() && Nhk23Servo::bulk_sender.peek(now)) Nhk23Servo::bulk_sender.advance(now);
+	}
+}
+
+/// @brief 入力はフレームの並び。1フレームは[0]: IDの番号(idsの添字), [1]: 下位4bitがDLC(9以上は8)、上位4bitが前のフレームからの時間[ms], 続いてDLC byteのデータ
+extern "C" int LLVMFuzzerTestOneInput(const u8 *const data, const std::size_t size)
+{
+	std::size_t i = 0;
+	while(i + 2 <= size)
+	{
+		const u32 id = ids[data[i] % ids.size()];
+		const u8 dlc = std::min(data[i + 1] & 0x0F, 8);
+		Host::tick += data[i + 1] >> 4;
+		i += 2;
+
+		ReceivedMessage message{};
+		message.id = id;
+		message.data.dlc = dlc;
+		for(u8 j = 0; j < dlc && i < size; ++j, ++i) message.data.buffer[j] = static_cast<byte>(data[i]);
+
+		if(0x201 <= id && id <= 0x203) (void)Nhk23Servo::fifo1_callback(message);
+		else (void)Nhk23Servo::fifo0_callback(message);
+
+		run_main_loop(Host::tick);
+	}
+	return 0;
+}
+
+#ifndef NHK23_SERVO_LIBFUZZER
+/// @brief 引数があればそのファイルを1つずつ入力として流す(libFuzzerが残したクラッシュの再現用)。なければ決まった種から作った入力をruns個流す
+int main(const int argc, char *const argv[])
+{
+	if(argc > 1)
+	{
+		for(int i = 1; i < argc; ++i)
+		{
+			std::ifstream file{argv[i], std::ios::binary};
+			const std::vector<u8> input{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+			(void)LLVMFuzzerTestOneInput(input.data(), input.size());
+		}
+		return 0;
+	}
+
+	constexpr u32 runs = 100'000;
+	constexpr std::size_t size_max = 256;
+	std::mt19937 random{0x4E'48'4B'23};
+	std::vector<u8> input{};
+	for(u32 run = 0; run < runs; ++run)
+	{
+		input.resize(std::uniform_int_distribution<std::size_t>{0, size_max}(random));
+		for(auto& octet : input) octet = static_cast<u8>(random());
+		(void)LLVMFuzzerTestOneInput(input.data(), input.size());
+	}
+	std::printf("%u inputs\n", static_cast<unsigned>(runs));
+	return 0;
+}
+#endif
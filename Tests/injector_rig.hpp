@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cmath>
+#include <functional>
+#include <optional>
+
+#include "host.hpp"
+
+#include <CRSLibtmp/std_type.hpp>
+#include "injector.hpp"
+
+namespace Test
+{
+	using namespace CRSLib::IntegerTypes;
+	using Nhk23Servo::Feedback;
+	using Nhk23Servo::Injector;
+	using Nhk23Servo::MotorState;
+
+	/// @brief C620とモーターの簡単なモデル。電流指令に比例して加速し、1msごとにフィードバックを返す
+	struct MotorModel final
+	{
+		// 1msあたり、電流指令1あたりの加速[rpm]。PIDのp=1で目標速度へ指数的に近づく
+		static constexpr double acceleration_per_current = 1.0 / 8;
+
+		i64 position{0};  // モーターの角度の累計。1回転8192
+		double speed{0.0};  // [rpm]
+		i16 current{0};
+		bool jammed{false};  // trueなら回らず、電流は指令どおりに流れる
+		std::optional<i64> stop_position{};  // 突き当て。これより負の側へは回らない
+
+		void step_ms(const i16 command) noexcept
+		{
+			current = command;
+			speed = jammed ? 0.0 : speed + command * acceleration_per_current;
+			position += std::llround(speed * MotorState::full_angle / 60'000);
+			if(stop_position && position < *stop_position)
+			{
+				position = *stop_position;
+				speed = 0.0;
+			}
+		}
+
+		Feedback feedback() const noexcept
+		{
+			const i64 angle = position % MotorState::full_angle;
+			return Feedback{.angle=static_cast<i16>(angle < 0 ? angle + MotorState::full_angle : angle), .speed=static_cast<i16>(std::lround(speed)), .current=current, .temperature=30};
+		}
+	};
+
+	/// @brief 1つのインジェクターをwrapper.cppと同じ順で動かす。フィードバックは1ms、制御は2msごと
+	struct InjectorRig final
+	{
+		static constexpr u32 control_period_ms = 2;
+		static constexpr float gear_ratio = 20.35f;
+
+		Injector injector{gear_ratio, CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}};
+		MotorModel motor{};
+		u32 now{0};
+		i16 current_limit{0x3C'00};
+		i16 command{0};
+		// 真を返したmsのフィードバックは届かない
+		std::function<bool()> drop_feedback{};
+		// ControlStateごとに、最後に入った時刻[ms]
+		std::array<std::optional<u32>, static_cast<std::size_t>(Injector::ControlState::N)> entered_ms{};
+
+		/// @brief 砲身を待機位置(原点から半周期)に置いて始める
+		InjectorRig() noexcept
+		{
+			motor.position = barrel_length();
+			injector.restore(0, barrel_length());
+			feed(1);
+		}
+
+		static i32 barrel_length() noexcept
+		{
+			return MotorState::full_angle * gear_ratio / 2;
+		}
+
+		void feed(const u32 ms) noexcept
+		{
+			for(u32 i = 0; i < ms; ++i)
+			{
+				motor.step_ms(command);
+				++now;
+				host_dwt.CYCCNT = host_dwt.CYCCNT + 72'000;
+				if(!drop_feedback || !drop_feedback()) injector.update_motor_state(motor.feedback(), now);
+			}
+		}
+
+		/// @brief 1制御周期進める
+		Injector::ControlState tick() noexcept
+		{
+			feed(control_period_ms);
+			const auto before = injector.get_control_state();
+			command = injector.run_and_calc_target(now, current_limit);
+			const auto after = injector.get_control_state();
+			if(after != before) entered_ms[static_cast<std::size_t>(after)] = now;
+			return after;
+		}
+
+		/// @brief predが真になるまで進める。max_ms以内にならなければfalse
+		template<class Predicate>
+		bool run_until(Predicate&& pred, const u32 max_ms) noexcept
+		{
+			const u32 start = now;
+			while(now - start < max_ms)
+			{
+				tick();
+				if(pred()) return true;
+			}
+			return false;
+		}
+
+		bool is(const Injector::ControlState state) const noexcept
+		{
+			return injector.get_control_state() == state;
+		}
+	};
+}
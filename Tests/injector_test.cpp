@@ -0,0 +1,370 @@
+#include <vector>
+
+#include "check.hpp"
+#include "injector_rig.hpp"
+#include "group_fire.hpp"
+
+using namespace Test;
+using State = Injector::ControlState;
+
+namespace
+{
+	// 1発の射出からIdleに戻るまでの時間の上限。SettingUpは遅いので長めに取る
+	constexpr u32 shot_cycle_max_ms = 30'000;
+	// Injector::Constantと同じ値
+	constexpr u16 jam_window_ticks = 25;
+	constexpr u8 jam_retry_max = 3;
+
+	/// @brief 積んだ射出はIdleに戻るたびに先頭から消費され、間隔の下限を守る
+	void test_burst_drains_queue()
+	{
+		InjectorRig rig{};
+		CHECK(rig.injector.inject_burst(3000, 3, 400));
+		CHECK(rig.injector.get_shot_counter().queued == 3);
+
+		std::vector<u32> shot_ms{};
+		const bool drained = rig.run_until([&]
+		{
+			if(rig.is(State::Injecting) && rig.entered_ms[static_cast<std::size_t>(State::Injecting)] == rig.now) shot_ms.push_back(rig.now);
+			return rig.injector.is_ready() && shot_ms.size() == 3;
+		}, 3 * shot_cycle_max_ms);
+
+		CHECK(drained);
+		CHECK(rig.is(State::Idle));
+		CHECK(rig.injector.get_shot_counter().fired == 3);
+		CHECK(rig.injector.get_shot_counter().dropped == 0);
+		for(std::size_t i = 1; i < shot_ms.size(); ++i) CHECK(shot_ms[i] - shot_ms[i - 1] >= 400);
+	}
+
+	/// @brief 射出中に受けた指令はキューで待ち、Idleに戻った次の制御周期で射出する
+	void test_command_during_shot_waits_for_idle()
+	{
+		InjectorRig rig{};
+		CHECK(rig.injector.inject_start(3000));
+		CHECK(rig.run_until([&]{ return rig.is(State::Injecting); }, 100));
+
+		CHECK(rig.injector.inject_start(2500));
+		CHECK(!rig.injector.is_ready());
+
+		CHECK(rig.run_until([&]{ return rig.is(State::Idle); }, shot_cycle_max_ms));
+		const u32 idle_ms = rig.now;
+		CHECK(rig.run_until([&]{ return rig.is(State::Injecting); }, 100));
+		CHECK(rig.now - idle_ms == InjectorRig::control_period_ms);
+		CHECK(rig.injector.get_shot_counter().fired == 2);
+	}
+
+	/// @brief キューが一杯なら捨てて数える。stopは残りを捨ててStoppingへ移る
+	void test_full_queue_and_stop()
+	{
+		InjectorRig rig{};
+		for(std::size_t i = 0; i < Injector::shot_queue_size; ++i) CHECK(rig.injector.inject_burst(3000, 2, 0));
+		CHECK(!rig.injector.inject_burst(3000, 5, 0));
+		CHECK(rig.injector.get_shot_counter().queued == 2 * Injector::shot_queue_size);
+		CHECK(rig.injector.get_shot_counter().dropped == 5);
+		CHECK(!rig.injector.inject_burst(3000, 0, 0));
+
+		CHECK(rig.run_until([&]{ return rig.is(State::Injecting); }, 100));
+		rig.injector.stop();
+		CHECK(rig.is(State::Stopping));
+		// 射出中の1発を除いた残り
+		CHECK(rig.injector.get_shot_counter().dropped == 5 + 2 * Injector::shot_queue_size - 1);
+
+		CHECK(rig.run_until([&]{ return rig.is(State::Idle); }, shot_cycle_max_ms));
+		CHECK(rig.injector.is_ready());
+		CHECK(rig.injector.get_shot_counter().fired == 1);
+	}
+
+	/// @brief 原点出しは指令したときだけ始まり、見つからなければhoming_timeout_ticksでFaultになる
+	/// @brief 負の向きに突き当てた位置を原点にし、SettingUpで正の向きに離れてIdleの待機位置に着く
+	void test_homing_hard_stop()
+	{
+		InjectorRig rig{};
+		// 待機位置から負の側に、1周期未満の離れた所に突き当てがある
+		const i64 stop_position = InjectorRig::barrel_length() / 3;
+		rig.motor.stop_position = stop_position;
+
+		rig.injector.start_homing();
+		CHECK(rig.run_until([&]{ return !rig.is(State::Homing); }, 10'000));
+		CHECK(rig.is(State::SettingUp));
+		CHECK(rig.motor.position == stop_position);
+		CHECK(rig.injector.take_homed_offset() == stop_position);
+		CHECK(rig.injector.fixed_position() == 0);
+
+		CHECK(rig.run_until([&]{ return rig.is(State::Idle); }, shot_cycle_max_ms));
+		CHECK(rig.injector.get_jam_counter().jams == 0);
+		CHECK(std::abs(rig.motor.position - stop_position - InjectorRig::barrel_length()) < InjectorRig::barrel_length() / 360);
+
+		// 原点が決まったので、射出してまた待機位置に戻れる
+		CHECK(rig.injector.inject_start(3000));
+		CHECK(rig.run_until([&]{ return !rig.is(State::Idle); }, 100));
+		CHECK(rig.run_until([&]{ return rig.injector.is_ready(); }, shot_cycle_max_ms));
+		CHECK(rig.injector.get_jam_counter().jams == 0);
+	}
+
+	void test_homing_timeout()
+	{
+		InjectorRig rig{};
+		CHECK(!rig.run_until([&]{ return !rig.is(State::Idle); }, 1000));
+		CHECK(rig.command == 0);
+
+		// 最初から回らなければ、突き当てたのか詰まったのか分からないので原点とはみなさない
+		rig.motor.jammed = true;
+		rig.injector.start_homing();
+		CHECK(rig.is(State::Homing));
+		CHECK(rig.run_until([&]{ return !rig.is(State::Homing); }, 10'000));
+		CHECK(rig.is(State::Fault));
+		CHECK(rig.now - 1 >= 2500 * InjectorRig::control_period_ms);
+		CHECK(!rig.injector.take_homed_offset().has_value());
+
+		rig.tick();
+		CHECK(rig.command == 0);
+
+		// Faultを解除すればSettingUpからやり直す
+		rig.motor.jammed = false;
+		rig.injector.clear_fault();
+		CHECK(rig.is(State::SettingUp));
+	}
+
+	/// @brief 詰まるとBackingOffで戻してSettingUpからやり直し、jam_retry_max回やり直しても詰まればFaultになる
+	void test_jam_backs_off_then_faults()
+	{
+		InjectorRig rig{};
+		// 待機位置で詰まるとSettingUpがすぐIdleになるので、少し進めてから詰まらせる
+		CHECK(rig.injector.inject_start(3000));
+		rig.run_until([]{ return false; }, 20);
+		// 上限を下げて、SettingUpでも電流指令が上限に張り付くようにする
+		rig.current_limit = 60;
+		rig.motor.jammed = true;
+
+		for(u8 retry = 1; retry <= jam_retry_max; ++retry)
+		{
+			const u32 jammed_ms = rig.now;
+			CHECK(rig.run_until([&]{ return rig.is(State::BackingOff); }, 1000));
+			// 電流が張り付いてからjam_window_ticksで検出する
+			CHECK(rig.now - jammed_ms <= (jam_window_ticks + 1) * InjectorRig::control_period_ms);
+			CHECK(rig.command < 0);
+			CHECK(rig.injector.get_jam_counter().retries == retry);
+
+			CHECK(rig.run_until([&]{ return !rig.is(State::BackingOff); }, 1000));
+			CHECK(rig.is(State::SettingUp));
+		}
+
+		CHECK(rig.run_until([&]{ return rig.is(State::Fault); }, 1000));
+		const auto& counter = rig.injector.get_jam_counter();
+		CHECK(counter.jams == jam_retry_max + 1);
+		CHECK(counter.retries == jam_retry_max);
+		CHECK(counter.faults == 1);
+
+		// Faultでは電流を流さず、clear_faultまでそのまま
+		CHECK(!rig.run_until([&]{ return !rig.is(State::Fault) || rig.command != 0; }, 1000));
+		rig.motor.jammed = false;
+		rig.injector.clear_fault();
+		CHECK(rig.is(State::SettingUp));
+	}
+
+	/// @brief 詰まりが取れてIdleに戻れば、やり直しの回数は数え直す
+	void test_jam_cleared_resets_retries()
+	{
+		InjectorRig rig{};
+		rig.current_limit = 60;
+		rig.motor.jammed = true;
+		CHECK(rig.injector.inject_start(3000));
+		CHECK(rig.run_until([&]{ return rig.is(State::BackingOff); }, 1000));
+
+		rig.motor.jammed = false;
+		rig.current_limit = 0x3C'00;
+		CHECK(rig.run_until([&]{ return rig.is(State::Idle); }, shot_cycle_max_ms));
+
+		for(u8 i = 0; i < jam_retry_max; ++i)
+		{
+			rig.current_limit = 60;
+			rig.motor.jammed = true;
+			CHECK(rig.injector.inject_start(3000));
+			CHECK(rig.run_until([&]{ return rig.is(State::BackingOff); }, 1000));
+			rig.motor.jammed = false;
+			rig.current_limit = 0x3C'00;
+			CHECK(rig.run_until([&]{ return rig.is(State::Idle); }, shot_cycle_max_ms));
+		}
+		CHECK(rig.injector.get_jam_counter().faults == 0);
+	}
+
+	/// @brief JamRecovery::Faultなら、やり直さずに最初の詰まりでFaultになる
+	void test_jam_recovery_fault()
+	{
+		InjectorRig rig{};
+		rig.injector.set_jam_recovery(Injector::JamRecovery::Fault);
+		rig.current_limit = 60;
+		rig.motor.jammed = true;
+		CHECK(rig.injector.inject_start(3000));
+
+		CHECK(rig.run_until([&]{ return !rig.is(State::Injecting); }, 1000));
+		CHECK(rig.is(State::Fault));
+		CHECK(!rig.entered_ms[static_cast<std::size_t>(State::BackingOff)].has_value());
+		CHECK(rig.injector.get_jam_counter().retries == 0);
+		CHECK(rig.injector.get_jam_counter().faults == 1);
+	}
+
+	/// @brief 3つのインジェクターをwrapper.cppと同じく、同時射出を先に進めてから制御する
+	struct GroupRig final
+	{
+		static constexpr std::array<float, 3> gear_ratios{20.35f, 18.75f, 14.85f};
+
+		std::array<Injector, 3> injectors
+		{
+			Injector{gear_ratios[0], CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}},
+			Injector{gear_ratios[1], CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}},
+			Injector{gear_ratios[2], CRSLib::Math::Pid<i16>{.p=1, .i=0, .d=0}}
+		};
+		std::array<MotorModel, 3> motors{};
+		std::array<i16, 3> commands{};
+		Nhk23Servo::GroupFire<3> group_fire{};
+		u32 now{0};
+		// インジェクターごとに、最後にInjectingへ入った時刻[ms]
+		std::array<u32, 3> injecting_ms{};
+
+		GroupRig() noexcept
+		{
+			for(u8 i = 0; i < 3; ++i)
+			{
+				const i32 barrel_length = MotorState::full_angle * gear_ratios[i] / 2;
+				motors[i].position = barrel_length;
+				injectors[i].restore(0, barrel_length);
+			}
+			feed(1);
+		}
+
+		void feed(const u32 ms) noexcept
+		{
+			for(u32 t = 0; t < ms; ++t)
+			{
+				++now;
+				for(u8 i = 0; i < 3; ++i)
+				{
+					motors[i].step_ms(commands[i]);
+					injectors[i].update_motor_state(motors[i].feedback(), now);
+				}
+			}
+		}
+
+		void tick() noexcept
+		{
+			feed(InjectorRig::control_period_ms);
+			host_dwt.CYCCNT = host_dwt.CYCCNT + 144'000;
+
+			group_fire.run(injectors, now);
+			for(u8 i = 0; i < 3; ++i)
+			{
+				const auto before = injectors[i].get_control_state();
+				commands[i] = injectors[i].run_and_calc_target(now, 0x3C'00);
+				if(before != State::Injecting && injectors[i].get_control_state() == State::Injecting) injecting_ms[i] = now;
+			}
+		}
+
+		template<class Predicate>
+		bool run_until(Predicate&& pred, const u32 max_ms) noexcept
+		{
+			const u32 start = now;
+			while(now - start < max_ms)
+			{
+				tick();
+				if(pred()) return true;
+			}
+			return false;
+		}
+	};
+
+	/// @brief 対象が全てIdleなら次の制御周期で一斉に射出し、対象外は動かさない
+	void test_group_fire_same_tick()
+	{
+		GroupRig rig{};
+		rig.group_fire.arm(0b101, 3000, rig.now);
+		rig.tick();
+
+		CHECK(rig.injectors[0].get_control_state() == State::Injecting);
+		CHECK(rig.injectors[1].get_control_state() == State::Idle);
+		CHECK(rig.injectors[2].get_control_state() == State::Injecting);
+		CHECK(rig.injecting_ms[0] == rig.injecting_ms[2]);
+		// 同じstepの中で遷移するので、サイクルカウンタの差も同じ制御周期の中に収まる
+		CHECK(rig.injectors[2].get_injection_start_cycle() - rig.injectors[0].get_injection_start_cycle() < 144'000);
+
+		const auto report = rig.group_fire.take_report();
+		CHECK(report.has_value());
+		if(report)
+		{
+			CHECK(report->mask == 0b101);
+			CHECK(report->result == Nhk23Servo::GroupFire<3>::Result::Fired);
+			CHECK(report->skew_cycles < 144'000);
+		}
+		CHECK(!rig.group_fire.is_armed());
+		CHECK(!rig.group_fire.take_report().has_value());
+	}
+
+	/// @brief 射出中のものがあれば、全てIdleに戻った制御周期まで待ってから揃えて射出する
+	void test_group_fire_waits_for_all()
+	{
+		// 同じ条件で1発射出し、Idleに戻る時刻を先に調べておく
+		GroupRig probe{};
+		CHECK(probe.injectors[1].fire_now(3000, probe.now));
+		CHECK(probe.run_until([&]{ return probe.injectors[1].is_ready(); }, shot_cycle_max_ms));
+		const u32 ready_ms = probe.now;
+
+		GroupRig rig{};
+		CHECK(rig.injectors[1].fire_now(3000, rig.now));
+		CHECK(rig.run_until([&]{ return rig.now + 300 >= ready_ms; }, shot_cycle_max_ms));
+		CHECK(!rig.injectors[1].is_ready());
+
+		rig.group_fire.arm(0b011, 2500, rig.now);
+		rig.tick();
+		CHECK(rig.injectors[0].get_control_state() == State::Idle);
+		CHECK(rig.group_fire.is_armed());
+
+		CHECK(rig.run_until([&]{ return rig.injectors[0].get_control_state() == State::Injecting; }, Nhk23Servo::GroupFire<3>::timeout_ms));
+		CHECK(rig.injectors[1].get_control_state() == State::Injecting);
+		CHECK(rig.injecting_ms[0] == rig.injecting_ms[1]);
+		CHECK(rig.now == ready_ms + InjectorRig::control_period_ms);
+		const auto report = rig.group_fire.take_report();
+		CHECK(report && report->result == Nhk23Servo::GroupFire<3>::Result::Fired);
+
+		// 同時射出も、キューを通した射出と同じく queued - dropped - fired が残りの発数になる
+		for(const auto& injector : rig.injectors)
+		{
+			const auto& counter = injector.get_shot_counter();
+			CHECK(counter.queued - counter.dropped - counter.fired == 0);
+		}
+		CHECK(rig.injectors[1].get_shot_counter().queued == 2);
+	}
+
+	/// @brief timeout_ms以内に揃わなければ射出せずTimeoutを返す
+	void test_group_fire_timeout()
+	{
+		GroupRig rig{};
+		rig.motors[2].jammed = true;
+		CHECK(rig.injectors[2].fire_now(3000, rig.now));
+		rig.tick();
+
+		rig.group_fire.arm(0b111, 3000, rig.now);
+		CHECK(rig.run_until([&]{ return !rig.group_fire.is_armed(); }, 2 * Nhk23Servo::GroupFire<3>::timeout_ms));
+
+		const auto report = rig.group_fire.take_report();
+		CHECK(report && report->result == Nhk23Servo::GroupFire<3>::Result::Timeout);
+		CHECK(report && report->mask == 0b111);
+		CHECK(rig.injectors[0].get_shot_counter().fired == 0);
+		CHECK(rig.injectors[1].get_shot_counter().fired == 0);
+	}
+}
+
+int main()
+{
+	test_burst_drains_queue();
+	test_command_during_shot_waits_for_idle();
+	test_full_queue_and_stop();
+	test_homing_hard_stop();
+	test_homing_timeout();
+	test_jam_backs_off_then_faults();
+	test_jam_cleared_resets_retries();
+	test_jam_recovery_fault();
+	test_group_fire_same_tick();
+	test_group_fire_waits_for_all();
+	test_group_fire_timeout();
+	return Test::result();
+}
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#include "check.hpp"
+#include "injector_rig.hpp"
+
+using namespace Test;
+using State = Injector::ControlState;
+
+// 乱数で作った軌跡と指令の列で、常に成り立つべき性質を調べる。失敗したら種を表示するので、その種だけ流せば再現できる
+namespace
+{
+	constexpr u32 cases = 200;
+	// C620が出せる最高速度程度[rpm]と、1msあたりの速度の変化の上限[rpm]
+	constexpr double speed_max = 9'000.0;
+	constexpr double acceleration_max = 100.0;
+	constexpr double drop_rate = 0.1;
+
+	i64 floor_mod(const i64 value, const i64 period)
+	{
+		const i64 ret = value % period;
+		return ret < 0 ? ret + period : ret;
+	}
+
+	/// @brief 本当のモーターの角度。1msごとに速度を変えて進める
+	struct Trajectory final
+	{
+		double position{0.0};  // 累計の角度
+		double speed{0.0};  // [rpm]
+
+		void step_ms(const double acceleration) noexcept
+		{
+			speed = std::clamp(speed + acceleration, -speed_max, speed_max);
+			position += speed * MotorState::full_angle / 60'000;
+		}
+
+		i64 total() const noexcept
+		{
+			return std::llround(position);
+		}
+
+		Feedback feedback() const noexcept
+		{
+			return Feedback{.angle=static_cast<i16>(floor_mod(total(), MotorState::full_angle)), .speed=static_cast<i16>(std::lround(speed)), .current=0, .temperature=30};
+		}
+	};
+
+	/// @brief 軌跡をMotorStateに流し、届いたフレームごとに累計の角度が本当の角度と(最初のフレームで決まる定数を除いて)一致するか調べる
+	/// @param acceleration 乱数から1msごとの速度の変化を作る
+	template<class Acceleration>
+	bool follows(std::mt19937& random, Trajectory trajectory, Acceleration&& acceleration, const u32 length_ms)
+	{
+		std::bernoulli_distribution drop{drop_rate};
+		std::bernoulli_distribution late{0.1};
+
+		MotorState state{};
+		state.update(trajectory.feedback(), 0);
+		const i64 base = trajectory.total() - state.get_total_angle();
+		u32 received_ms = 0;
+
+		for(u32 ms = 1; ms <= length_ms; ++ms)
+		{
+			trajectory.step_ms(acceleration(random, trajectory));
+			if(drop(random)) continue;
+
+			// FIFOで待たされたフレームは、次のフレームと同じ時刻に受けたことになる
+			received_ms = std::max(received_ms, late(random) ? ms + 1 : ms);
+			state.update(trajectory.feedback(), received_ms);
+			if(state.get_total_angle() + base != trajectory.total()) return false;
+		}
+		return true;
+	}
+
+	/// @brief 一方向に加減速する。速度は0を跨がない
+	void test_monotone_trajectory()
+	{
+		for(u32 seed = 0; seed < cases; ++seed)
+		{
+			std::mt19937 random{seed};
+			const double sign = seed % 2 == 0 ? 1.0 : -1.0;
+			Trajectory trajectory{.position=std::uniform_real_distribution<double>{-1e6, 1e6}(random), .speed=0.0};
+
+			const bool ok = follows(random, trajectory, [sign](std::mt19937& random, const Trajectory& trajectory)
+			{
+				const double acceleration = std::uniform_real_distribution<double>{-acceleration_max, acceleration_max}(random);
+				// 符号を保つ
+				return sign * std::max(sign * (trajectory.speed + acceleration), 0.0) - trajectory.speed;
+			}, 5'000);
+			if(!CHECK(ok)) std::fprintf(stderr, "  seed %u\n", static_cast<unsigned>(seed));
+		}
+	}
+
+	/// @brief 目標速度を時々選び直して向かう。正逆の切り替えを何度も含む
+	void test_reversing_trajectory()
+	{
+		for(u32 seed = 0; seed < cases; ++seed)
+		{
+			std::mt19937 random{seed};
+			Trajectory trajectory{.position=std::uniform_real_distribution<double>{-1e6, 1e6}(random), .speed=0.0};
+			double target = 0.0;
+
+			const bool ok = follows(random, trajectory, [&target](std::mt19937& random, const Trajectory& trajectory)
+			{
+				if(std::bernoulli_distribution{0.005}(random)) target = std::uniform_real_distribution<double>{-speed_max, speed_max}(random);
+				return std::clamp(target - trajectory.speed, -acceleration_max, acceleration_max);
+			}, 5'000);
+			if(!CHECK(ok)) std::fprintf(stderr, "  seed %u\n", static_cast<unsigned>(seed));
+		}
+	}
+
+	/// @brief fixed_positionは累計の角度が負でも[0, 2 * barrel_length)に収まり、進んだ角度を周期で割った余りだけ動く
+	void test_fixed_position_modulo()
+	{
+		for(u32 seed = 0; seed < cases; ++seed)
+		{
+			std::mt19937 random{seed};
+			InjectorRig rig{};
+			const i32 period = 2 * InjectorRig::barrel_length();
+			// 原点を負の側に置き、負の向きに回して、累計の角度を最初から負にする
+			rig.injector.restore(std::uniform_int_distribution<i32>{-3 * period, -period}(random), std::uniform_int_distribution<i32>{0, period - 1}(random));
+			rig.motor.position = std::uniform_int_distribution<i64>{-period, period}(random);
+			rig.motor.speed = -std::uniform_real_distribution<double>{1'000, speed_max}(random);
+			rig.feed(1);
+			const i64 start_position = rig.motor.position;
+			const i32 start_fixed = rig.injector.fixed_position();
+
+			bool ok = true;
+			for(u32 ms = 0; ms < 2'000 && ok; ++ms)
+			{
+				rig.command = std::uniform_int_distribution<i16>{-400, 400}(random);
+				rig.feed(1);
+				const i32 position = rig.injector.fixed_position();
+				ok = 0 <= position && position < period && position == floor_mod(start_fixed + rig.motor.position - start_position, period);
+			}
+			if(!CHECK(ok)) std::fprintf(stderr, "  seed %u\n", static_cast<unsigned>(seed));
+		}
+	}
+
+	/// @brief どんな指令の並びでも、フィードバックが落ちても、詰まらなければ指令が止んだ後にIdleへ戻り、積んだ射出は全て撃つか捨てる
+	void test_injector_returns_to_idle()
+	{
+		// 1発の射出からIdleに戻るまでの時間の上限(injector_test.cppと同じ)
+		constexpr u32 shot_cycle_max_ms = 30'000;
+
+		for(u32 seed = 0; seed < cases / 10; ++seed)
+		{
+			std::mt19937 random{seed};
+			InjectorRig rig{};
+			std::bernoulli_distribution drop{drop_rate};
+			rig.drop_feedback = [&]{ return drop(random); };
+
+			// 最初の2秒に、ランダムな時刻に射出と停止を指令する。requestedは指令した発数で、キューが一杯で捨てたものも含む
+			std::bernoulli_distribution command{0.01};
+			u32 requested = 0;
+			while(rig.now < 2'000)
+			{
+				rig.tick();
+				if(!command(random)) continue;
+
+				const i16 speed = std::uniform_int_distribution<i16>{500, 6'000}(random);
+				switch(std::uniform_int_distribution<u8>{0, 4}(random))
+				{
+					case 0:
+					{
+						rig.injector.stop();
+					}
+					break;
+
+					case 1:
+					{
+						const u8 count = std::uniform_int_distribution<u8>{1, 3}(random);
+						(void)rig.injector.inject_burst(speed, count, std::uniform_int_distribution<u16>{0, 300}(random));
+						requested += count;
+					}
+					break;
+
+					default:
+					{
+						(void)rig.injector.inject_start(speed);
+						++requested;
+					}
+					break;
+				}
+			}
+
+			const auto& counter = rig.injector.get_shot_counter();
+			const u32 shots = requested - counter.fired - counter.dropped;
+			const bool idle = rig.run_until([&]{ return rig.injector.is_ready() && rig.is(State::Idle); }, (shots + 1) * shot_cycle_max_ms);
+			if(!CHECK(idle)) std::fprintf(stderr, "  seed %u: state %u\n", static_cast<unsigned>(seed), static_cast<unsigned>(rig.injector.get_control_state()));
+			CHECK(requested == u32{counter.fired} + counter.dropped);
+			CHECK(rig.injector.get_jam_counter().jams == 0);
+		}
+	}
+}
+
+int main()
+{
+	test_monotone_trajectory();
+	test_reversing_trajectory();
+	test_fixed_position_modulo();
+	test_injector_returns_to_idle();
+	return Test::result();
+}
@@ -0,0 +1,170 @@
+#include <string>
+
+#include "check.hpp"
+#include "host.hpp"
+#include "state_machine.hpp"
+
+using namespace Nhk23Servo;
+
+namespace
+{
+	/// @brief 呼ばれた順に1文字ずつlogへ残す状態機械
+	class Lamp final
+	{
+		public:
+		enum class State : u8
+		{
+			Off,
+			On,
+			Blink,
+			N
+		};
+
+		std::string log{};
+		bool switch_on{false};
+		bool blink{false};
+		bool switch_off{false};
+
+		private:
+		i16 run_off() noexcept
+		{
+			log += 'o';
+			return 0;
+		}
+		i16 run_on() noexcept
+		{
+			log += 'n';
+			return 1;
+		}
+		i16 run_blink() noexcept
+		{
+			log += 'b';
+			return 2;
+		}
+		void enter_on() noexcept
+		{
+			log += '[';
+		}
+		void exit_on() noexcept
+		{
+			log += ']';
+		}
+		void count() noexcept
+		{
+			log += '+';
+		}
+		bool is_switch_on() const noexcept
+		{
+			return switch_on;
+		}
+		bool is_blink() const noexcept
+		{
+			return blink;
+		}
+		bool is_switch_off() const noexcept
+		{
+			return switch_off;
+		}
+
+		public:
+		struct Table final
+		{
+			using Owner = Lamp;
+			using State = Lamp::State;
+			using Output = i16;
+
+			static constexpr std::array<StateAction<Lamp, i16>, static_cast<std::size_t>(State::N)> states
+			{{
+				{.run=&Lamp::run_off},
+				{.run=&Lamp::run_on, .entry=&Lamp::enter_on, .exit=&Lamp::exit_on},
+				{.run=&Lamp::run_blink}
+			}};
+
+			static constexpr std::array<StateTransition<Lamp, State>, 4> transitions
+			{{
+				{.from=State::Off, .to=State::Blink, .guard=&Lamp::is_blink},
+				{.from=State::Off, .to=State::On, .guard=&Lamp::is_switch_on, .action=&Lamp::count},
+				{.from=State::On, .to=State::Off, .guard=&Lamp::is_switch_off, .action=&Lamp::count},
+				{.from=State::Blink, .to=State::Off, .guard=&Lamp::is_switch_off}
+			}};
+		};
+
+		StateMachine<Table> state{State::Off};
+	};
+
+	using State = Lamp::State;
+
+	/// @brief 遷移はexit、action、entryの順で、同じstepで遷移先のrunを呼ぶ。初期状態のentryは呼ばない
+	void test_step_order()
+	{
+		Lamp lamp{};
+		CHECK(lamp.state.step(lamp) == 0);
+		CHECK(lamp.log == "o");
+
+		lamp.switch_on = true;
+		CHECK(lamp.state.step(lamp) == 1);
+		CHECK(lamp.state.is(State::On));
+		CHECK(lamp.log == "o+[n");
+
+		lamp.switch_off = true;
+		CHECK(lamp.state.step(lamp) == 0);
+		CHECK(lamp.state.is(State::Off));
+		CHECK(lamp.log == "o+[n]+o");
+	}
+
+	/// @brief 同じfromの遷移は表で先にあるものを優先し、1回のstepで1回しか遷移しない
+	void test_guard_priority()
+	{
+		Lamp lamp{};
+		lamp.switch_on = true;
+		lamp.blink = true;
+		lamp.switch_off = true;
+
+		CHECK(lamp.state.step(lamp) == 2);
+		CHECK(lamp.state.is(State::Blink));
+		CHECK(lamp.state.step(lamp) == 0);
+		CHECK(lamp.state.is(State::Off));
+		CHECK(lamp.log == "bo");
+	}
+
+	/// @brief 表によらない遷移は、同じ状態へでもexitとentryを呼ぶ
+	void test_transit()
+	{
+		Lamp lamp{};
+		lamp.state.transit(lamp, State::On);
+		CHECK(lamp.log == "[");
+		lamp.state.transit(lamp, State::On);
+		CHECK(lamp.log == "[][");
+		lamp.state.transit(lamp, State::Off);
+		CHECK(lamp.log == "[][]");
+		CHECK(lamp.state.is(State::Off));
+	}
+
+	/// @brief 入った回数とtick数を状態ごとに数える
+	void test_stats()
+	{
+		Lamp lamp{};
+		for(u8 i = 0; i < 3; ++i) (void)lamp.state.step(lamp);
+		lamp.switch_on = true;
+		for(u8 i = 0; i < 2; ++i) (void)lamp.state.step(lamp);
+
+		CHECK(lamp.state.get_stats(State::Off).entries == 0);
+		CHECK(lamp.state.get_stats(State::Off).ticks == 3);
+		CHECK(lamp.state.get_stats(State::On).entries == 1);
+		CHECK(lamp.state.get_stats(State::On).ticks == 2);
+		CHECK(lamp.state.get_stats(State::Blink).ticks == 0);
+
+		lamp.state.reset_stats();
+		CHECK(lamp.state.get_stats(State::On).entries == 0);
+		CHECK(lamp.state.get_stats(State::On).ticks == 0);
+	}
+}
+
+int main()
+{
+	test_step_order();
+	test_guard_priority();
+	test_transit();
+	test_stats();
+	return Test::result();
+}
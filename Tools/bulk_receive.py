@@ -0,0 +1,311 @@
+#!/usr/bin/env python3
+"""分割転送(Core/Inc/bulk_transfer.hpp)でボードからデータを受け取る。
+
+0x149に要求とFlow Controlを送り、0x3F0で受け取る。形はISO-TP(ISO 15765-2)と同じ。
+
+    python3 Tools/bulk_receive.py --channel can0 identification -o capture.csv
+    python3 Tools/bulk_receive.py --channel can0 blackbox -o blackbox.csv
+    python3 Tools/bulk_receive.py --simulate --size 4000 --loss 0.01 identification
+
+ブラックボックスは止まっているときだけ読める(0x14Aの[0]=0で止める、[0]=1で記録し直す)。
+
+通し番号が飛んだり途中で止まったりしたら、届いたところからの続きを要求する(要求の[2-5]がオフセット)。
+続けて--retries回、1byteも進まなければ諦める。実機にはpython-canが要る。
+"""
+
+import argparse
+import queue
+import random
+import struct
+import sys
+import threading
+import time
+
+REQUEST_ID = 0x149
+REPLY_ID = 0x3F0
+
+# Core/Src/wrapper.cppのBulk
+KINDS = {"identification": 0, "blackbox": 1}
+TRIGGERS = ["none", "command", "fault", "jam", "watchdog"]
+STATES = ["idle", "injecting", "stopping", "setting_up", "homing", "backing_off", "fault"]
+
+
+class ReceiveError(Exception):
+    pass
+
+
+class PythonCanBus:
+    def __init__(self, interface, channel, bitrate):
+        import can  # 実機のときだけ要る
+
+        self._can = can
+        self._bus = can.Bus(interface=interface, channel=channel, bitrate=bitrate,
+                            can_filters=[{"can_id": REPLY_ID, "can_mask": 0x7FF}])
+        self.replies = queue.Queue()
+        self._running = True
+        self._thread = threading.Thread(target=self._receive, daemon=True)
+        self._thread.start()
+
+    def _receive(self):
+        while self._running:
+            message = self._bus.recv(0.1)
+            if message is not None and message.arbitration_id == REPLY_ID:
+                self.replies.put(bytes(message.data))
+
+    def send(self, data):
+        self._bus.send(self._can.Message(arbitration_id=REQUEST_ID, data=bytes(data), is_extended_id=False))
+
+    def close(self):
+        self._running = False
+        self._thread.join()
+        self._bus.shutdown()
+
+
+class SimulatedSender:
+    """BulkSenderと同じ振る舞いをする。フレームは同期して返す"""
+
+    def __init__(self, payload):
+        self.whole = self.payload = payload
+        self.phase = "idle"
+        self.offset = self.sequence = self.block_size = self.block_left = 0
+
+    def on_request(self, data, emit):
+        if 1 <= data[0] <= 7:
+            base = int.from_bytes(data[2:6], "big") if data[0] >= 5 and len(data) >= 6 else 0
+            self.phase = "idle"
+            if base >= len(self.whole):
+                return
+            self.payload = self.whole[base:]
+            self.offset = 0
+            self.phase = "sending"
+            self.pump(emit)
+        elif data[0] >> 4 == 3 and self.phase == "wait":
+            if data[0] == 0x30:
+                self.block_size = self.block_left = data[1]
+                self.phase = "sending"
+                self.pump(emit)
+            elif data[0] != 0x31:
+                self.phase = "idle"
+
+    def pump(self, emit):
+        size = len(self.payload)
+        while self.phase == "sending":
+            if self.offset == 0:
+                if size <= 7:
+                    emit(bytes([size]) + self.payload)
+                    self.phase = "idle"
+                    return
+                if size <= 0xFFF:
+                    emit(bytes([0x10 | size >> 8, size & 0xFF]) + self.payload[:6])
+                    self.offset = 6
+                else:
+                    emit(bytes([0x10, 0x00]) + size.to_bytes(4, "big") + self.payload[:2])
+                    self.offset = 2
+                self.sequence = 1
+                self.phase = "wait"
+                return
+            chunk = self.payload[self.offset:self.offset + 7]
+            emit(bytes([0x20 | self.sequence & 0xF]) + chunk)
+            self.offset += len(chunk)
+            self.sequence += 1
+            if self.offset >= size:
+                self.phase = "idle"
+            elif self.block_size != 0:
+                self.block_left -= 1
+                if self.block_left == 0:
+                    self.phase = "wait"
+
+
+class SimulatedBus:
+    def __init__(self, payload, loss=0.0, seed=None):
+        self.sender = SimulatedSender(payload)
+        self.replies = queue.Queue()
+        self.loss = loss
+        self.random = random.Random(seed)
+
+    def send(self, data):
+        if self.random.random() < self.loss:
+            return
+
+        def emit(frame):
+            if self.random.random() >= self.loss:
+                self.replies.put(frame)
+
+        self.sender.on_request(bytes(data), emit)
+
+    def close(self):
+        pass
+
+
+class Receiver:
+    def __init__(self, bus, block_size, separation_time, timeout, retries):
+        self.bus = bus
+        self.block_size = block_size
+        self.separation_time = separation_time
+        self.timeout = timeout
+        self.retries = retries
+        self.size = None  # 全体の長さ。最初のFirst Frameで分かる
+
+    def receive(self, timeout):
+        try:
+            return self.bus.replies.get(timeout=timeout)
+        except queue.Empty:
+            raise ReceiveError("timeout") from None
+
+    def flow_control(self):
+        self.bus.send(bytes([0x30, self.block_size, self.separation_time]))
+
+    def transfer(self, kind):
+        """全て受け取るまで、届いたところからの続きを要求し直す"""
+        data = bytearray()
+        self.size = None
+        failures = 0
+        while True:
+            received = len(data)
+            try:
+                self.request(kind, data)
+                return bytes(data)
+            except ReceiveError as error:
+                print(f"at {len(data)}/{'?' if self.size is None else self.size}: {error}", file=sys.stderr)
+                failures = 0 if len(data) > received else failures + 1
+                if failures >= self.retries:
+                    raise ReceiveError(f"no progress after {failures} requests") from None
+
+    def request(self, kind, data):
+        """dataの続きを要求して足していく。途中で失敗しても、届いた分はdataに残る"""
+        while not self.bus.replies.empty():
+            self.bus.replies.get_nowait()
+        offset = len(data)
+        if offset == 0:
+            self.bus.send(bytes([0x01, kind]))
+        else:
+            self.bus.send(bytes([0x05, kind]) + offset.to_bytes(4, "big"))
+
+        first = self.receive(self.timeout)
+        if first[0] >> 4 == 0:
+            rest = first[1:1 + (first[0] & 0xF)]
+            self.check_size(data, offset + len(rest))
+            data += rest
+            return
+        if first[0] >> 4 != 1:
+            raise ReceiveError(f"unexpected frame {first.hex()}")
+
+        rest = (first[0] & 0xF) << 8 | first[1]
+        payload = first[2:]
+        if rest == 0:
+            rest = int.from_bytes(first[2:6], "big")
+            payload = first[6:]
+        self.check_size(data, offset + rest)
+        data += payload
+
+        sequence = 1
+        block_left = self.block_size
+        self.flow_control()
+        while len(data) < self.size:
+            frame = self.receive(self.timeout)
+            if frame[0] >> 4 != 2 or frame[0] & 0xF != sequence & 0xF:
+                raise ReceiveError("sequence error")
+            data += frame[1:]
+            sequence += 1
+            if self.block_size != 0 and len(data) < self.size:
+                block_left -= 1
+                if block_left == 0:
+                    block_left = self.block_size
+                    self.flow_control()
+        del data[self.size:]
+
+    def check_size(self, data, size):
+        """続きの長さが合わなければ、ボードのデータが変わったので最初から受け取り直す"""
+        if self.size is not None and size != self.size:
+            data.clear()
+            self.size = None
+            raise ReceiveError(f"size changed to {size}, starting over")
+        self.size = size
+
+
+def format_identification(data):
+    lines = ["command,angle,speed,current"]
+    for offset in range(0, len(data) - len(data) % 8, 8):
+        lines.append(",".join(str(value) for value in struct.unpack(">4h", data[offset:offset + 8])))
+    return "\n".join(lines) + "\n"
+
+
+def format_black_box(data):
+    """ヘッダ4byteの後にControlRecord(28byte)が古い順に並ぶ"""
+    if len(data) < 4:
+        return ""
+    trigger, decimation, trigger_index = data[0], data[1], int.from_bytes(data[2:4], "big")
+    lines = [f"# trigger={TRIGGERS[trigger] if trigger < len(TRIGGERS) else trigger} decimation={decimation} trigger_index={trigger_index}"]
+    columns = ["index", "time_ms"]
+    for motor in range(3):
+        columns += [f"state{motor}", f"command{motor}", f"angle{motor}", f"speed{motor}", f"current{motor}"]
+    lines.append(",".join(columns))
+    body = data[4:]
+    for index, offset in enumerate(range(0, len(body) - len(body) % 28, 28)):
+        time_ms, states, *motors = struct.unpack(">HH12h", body[offset:offset + 28])
+        row = [str(index - trigger_index), str(time_ms)]
+        for motor in range(3):
+            state = states >> (4 * motor) & 0xF
+            row.append(STATES[state] if state < len(STATES) else str(state))
+            row += [str(value) for value in motors[4 * motor:4 * motor + 4]]
+        lines.append(",".join(row))
+    return "\n".join(lines) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("kind", choices=sorted(KINDS))
+    parser.add_argument("-o", "--output", help="write here instead of stdout (.bin is raw)")
+    parser.add_argument("--interface", default="socketcan")
+    parser.add_argument("--channel", default="can0")
+    parser.add_argument("--bitrate", type=int, default=750_000)
+    parser.add_argument("--block-size", type=int, default=16, help="frames per flow control, 0 for no limit")
+    parser.add_argument("--separation-time", type=lambda s: int(s, 0), default=0, help="STmin byte (ms, or 0xF1-0xF9 for 100-900 us)")
+    parser.add_argument("--timeout", type=float, default=1.0)
+    parser.add_argument("--retries", type=int, default=5, help="give up after this many requests in a row that receive nothing new")
+    parser.add_argument("--simulate", action="store_true", help="receive from a simulated sender")
+    parser.add_argument("--size", type=int, default=4000, help="payload size for --simulate")
+    parser.add_argument("--loss", type=float, default=0.0, help="frame loss ratio for --simulate")
+    parser.add_argument("--seed", type=int)
+    args = parser.parse_args()
+
+    if args.simulate:
+        payload = bytes(random.Random(args.seed).randrange(256) for _ in range(args.size))
+        bus = SimulatedBus(payload, loss=args.loss, seed=args.seed)
+        timeout = min(args.timeout, 0.05)
+    else:
+        bus = PythonCanBus(args.interface, args.channel, args.bitrate)
+        timeout = args.timeout
+
+    receiver = Receiver(bus, args.block_size, args.separation_time, timeout, args.retries)
+    start = time.monotonic()
+    try:
+        data = receiver.transfer(KINDS[args.kind])
+    except ReceiveError as error:
+        print(error.args[0], file=sys.stderr)
+        return 1
+    finally:
+        bus.close()
+
+    elapsed = time.monotonic() - start
+    if args.simulate and data != payload:
+        print("received data does not match the simulated payload", file=sys.stderr)
+        return 1
+    print(f"received {len(data)} bytes in {elapsed:.2f} s", file=sys.stderr)
+
+    if args.output and args.output.endswith(".bin"):
+        with open(args.output, "wb") as file:
+            file.write(data)
+        return 0
+
+    text = format_identification(data) if args.kind == "identification" else format_black_box(data)
+    if args.output:
+        with open(args.output, "w") as file:
+            file.write(text)
+    elif not args.simulate:
+        sys.stdout.write(text)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
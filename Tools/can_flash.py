@@ -0,0 +1,418 @@
+#!/usr/bin/env python3
+"""CAN経由でブートローダ(Bootloader/)にアプリケーションを書き込む。
+
+取り決めはCore/Inc/boot_layout.hppと同じ。ボードがアプリケーションで動いていれば、
+先に0x147に"BOOT"を送ってブートローダに入れる。
+
+    python3 Tools/can_flash.py --channel can0 --nodes 1 2 3 --enter build/slot_a.bin build/slot_b.bin
+    python3 Tools/can_flash.py --simulate --nodes 1 2 3 --loss 0.05 --size 20000
+    python3 Tools/can_flash.py --check build/slot_a.bin build/slot_b.bin
+
+イメージはスロットA用とスロットB用の2つを渡す。ブートローダが次に書くスロットを答えるので、そちらを送る。
+複数のノードは並行して書き込む。実機にはpython-canが要る。
+"""
+
+import argparse
+import os
+import queue
+import random
+import sys
+import threading
+import time
+import zlib
+
+COMMAND_ID_BASE = 0x700
+REPLY_ID_BASE = 0x780
+APP_BOOTLOADER_ID = 0x147
+
+QUERY, START, DATA, FINISH, BOOT = range(5)
+ACK, NACK, ERROR = range(3)
+
+DATA_PER_FRAME = 6
+SLOT_SIZE = 27 * 1024
+TRAILER_SIZE = 20
+IMAGE_CAPACITY = SLOT_SIZE - TRAILER_SIZE
+SLOT_ADDRESSES = (0x0800_2000, 0x0800_8C00)
+RAM_BASE = 0x2000_0000
+RAM_SIZE = 20 * 1024
+
+
+class FlashError(Exception):
+    pass
+
+
+def check_image(image, slot):
+    """ブートローダのis_bootableと同じ確認を書き込む前に行う。別のスロット用にリンクしたイメージを弾く"""
+    if not 8 <= len(image) <= IMAGE_CAPACITY:
+        return f"image for slot {slot} is {len(image)} bytes, capacity is {IMAGE_CAPACITY}"
+    stack = int.from_bytes(image[0:4], "little")
+    reset = int.from_bytes(image[4:8], "little")
+    if not RAM_BASE < stack <= RAM_BASE + RAM_SIZE:
+        return f"image for slot {slot} has initial stack pointer {stack:#010x} outside RAM"
+    if not SLOT_ADDRESSES[slot] <= reset < SLOT_ADDRESSES[slot] + len(image):
+        return f"image for slot {slot} has reset vector {reset:#010x}, it is not linked for this slot"
+    return None
+
+
+def make_test_image(slot, size):
+    """--simulateで使う、ベクタテーブルだけそれらしいイメージ"""
+    vector = (RAM_BASE + RAM_SIZE).to_bytes(4, "little") + (SLOT_ADDRESSES[slot] + 0x10D).to_bytes(4, "little")
+    return vector + os.urandom(size - len(vector))
+
+
+class Bus:
+    """ノードごとに返事を振り分ける。python-canでもシミュレーションでも同じ形で使う"""
+
+    def __init__(self):
+        self._queues = {}
+        self._lock = threading.Lock()
+
+    def subscribe(self, node):
+        with self._lock:
+            self._queues[node] = queue.Queue()
+        return self._queues[node]
+
+    def dispatch(self, arbitration_id, data):
+        node = arbitration_id - REPLY_ID_BASE
+        with self._lock:
+            q = self._queues.get(node)
+        if q is not None:
+            q.put(bytes(data))
+
+    def send(self, arbitration_id, data):
+        raise NotImplementedError
+
+    def close(self):
+        pass
+
+
+class PythonCanBus(Bus):
+    def __init__(self, interface, channel, bitrate):
+        super().__init__()
+        import can  # 実機のときだけ要る
+
+        self._can = can
+        self._bus = can.Bus(interface=interface, channel=channel, bitrate=bitrate)
+        self._running = True
+        self._thread = threading.Thread(target=self._receive, daemon=True)
+        self._thread.start()
+
+    def _receive(self):
+        while self._running:
+            message = self._bus.recv(0.1)
+            if message is not None and not message.is_extended_id:
+                self.dispatch(message.arbitration_id, message.data)
+
+    def send(self, arbitration_id, data):
+        self._bus.send(self._can.Message(arbitration_id=arbitration_id, data=bytes(data), is_extended_id=False))
+
+    def close(self):
+        self._running = False
+        self._thread.join()
+        self._bus.shutdown()
+
+
+class SimulatedNode:
+    """Bootloader/Src/main.cppのReceiverと同じ振る舞いをする"""
+
+    def __init__(self, node, window=16):
+        self.node = node
+        self.window = window
+        self.slots = [bytearray(b"\xff" * SLOT_SIZE) for _ in range(2)]
+        self.trailers = [None, None]
+        self.target = None
+        self.size = self.crc = self.offset = self.since_ack = 0
+
+    def newest(self, confirmed_only=False):
+        valid = [(t["sequence"], i) for i, t in enumerate(self.trailers)
+                 if t is not None and (t["confirmed"] or not confirmed_only)]
+        return max(valid)[1] if valid else None
+
+    def next_target(self):
+        keep = self.newest(confirmed_only=True)
+        if keep is None:
+            keep = self.newest()
+        return 1 if keep == 0 else 0
+
+    def handle(self, data, reply):
+        command = data[0]
+        if command == QUERY:
+            newest = self.newest()
+            reply(bytes([ACK, command, 0xFF if newest is None else newest, self.next_target(), self.window]))
+        elif command == START:
+            if len(data) < 8:
+                reply(bytes([ERROR, command]))
+                return
+            self.size = int.from_bytes(data[1:4], "big")
+            self.crc = int.from_bytes(data[4:8], "big")
+            self.target = self.next_target()
+            self.offset = self.since_ack = 0
+            ok = 0 < self.size <= IMAGE_CAPACITY
+            if ok:
+                self.slots[self.target][:] = b"\xff" * SLOT_SIZE
+                self.trailers[self.target] = None
+            else:
+                self.target = None
+            reply(bytes([ACK if ok else ERROR, command, self.target if ok else 0xFF]))
+        elif command == DATA:
+            if self.target is None or len(data) < 2:
+                return
+            if data[1] != (self.offset // DATA_PER_FRAME) & 0xFF or self.offset >= self.size:
+                self.since_ack = 0
+                reply(bytes([NACK, DATA]) + self.offset.to_bytes(4, "big"))
+                return
+            length = min(len(data) - 2, self.size - self.offset)
+            self.slots[self.target][self.offset:self.offset + length] = data[2:2 + length]
+            self.offset += length
+            self.since_ack += 1
+            if self.since_ack >= self.window or self.offset == self.size:
+                self.since_ack = 0
+                reply(bytes([ACK, DATA]) + self.offset.to_bytes(4, "big"))
+        elif command == FINISH:
+            if self.target is None:
+                newest = self.newest()
+                ok = (self.size != 0 and newest is not None
+                      and self.trailers[newest]["size"] == self.size and self.trailers[newest]["crc"] == self.crc)
+                reply(bytes([ACK if ok else ERROR, command]))
+                return
+            ok = self.offset == self.size and zlib.crc32(bytes(self.slots[self.target][:self.size])) == self.crc
+            if ok:
+                newest = self.newest()
+                sequence = 0 if newest is None else self.trailers[newest]["sequence"] + 1
+                self.trailers[self.target] = {"size": self.size, "crc": self.crc, "sequence": sequence, "confirmed": False}
+            self.target = None
+            reply(bytes([ACK if ok else ERROR, command]))
+        elif command == BOOT:
+            reply(bytes([ACK, command]))
+        else:
+            reply(bytes([ERROR, command]))
+
+
+class SimulatedBus(Bus):
+    """lossの割合でフレームを落とす。落とすのは双方向"""
+
+    def __init__(self, nodes, loss=0.0, seed=None):
+        super().__init__()
+        self.nodes = {node: SimulatedNode(node) for node in nodes}
+        self.loss = loss
+        self.random = random.Random(seed)
+        self._lock = threading.Lock()
+
+    def _lost(self):
+        with self._lock:
+            return self.random.random() < self.loss
+
+    def send(self, arbitration_id, data):
+        if arbitration_id == APP_BOOTLOADER_ID:
+            return
+        node = self.nodes.get(arbitration_id - COMMAND_ID_BASE)
+        if node is None or self._lost():
+            return
+
+        def reply(payload):
+            if not self._lost():
+                self.dispatch(REPLY_ID_BASE + node.node, payload)
+
+        node.handle(bytes(data), reply)
+
+
+class Flasher:
+    """1ノード分。windowフレーム送って返事を待つGo-Back-N"""
+
+    def __init__(self, bus, node, timeout=0.2, retries=20, log=None):
+        self.bus = bus
+        self.node = node
+        self.timeout = timeout
+        self.retries = retries
+        self.replies = bus.subscribe(node)
+        self.log = log or (lambda text: None)
+
+    def send(self, payload):
+        self.bus.send(COMMAND_ID_BASE + self.node, payload)
+
+    def receive(self, timeout):
+        try:
+            return self.replies.get(timeout=timeout)
+        except queue.Empty:
+            return None
+
+    def drain(self):
+        while not self.replies.empty():
+            self.replies.get_nowait()
+
+    def request(self, payload, timeout=None):
+        """返事のあるコマンドを送り直しながら待つ"""
+        for _ in range(self.retries):
+            self.drain()
+            self.send(payload)
+            deadline = time.monotonic() + (timeout or self.timeout)
+            while (remaining := deadline - time.monotonic()) > 0:
+                reply = self.receive(remaining)
+                if reply is not None and len(reply) >= 2 and reply[1] == payload[0]:
+                    return reply
+        raise FlashError(f"node {self.node}: no reply to command {payload[0]}")
+
+    def query(self):
+        reply = self.request(bytes([QUERY]))
+        if reply[0] != ACK or len(reply) < 5:
+            raise FlashError(f"node {self.node}: query failed")
+        return (None if reply[2] == 0xFF else reply[2]), reply[3], reply[4]
+
+    def flash(self, images):
+        _, target, window = self.query()
+        image = images[target]
+        if (error := check_image(image, target)) is not None:
+            raise FlashError(f"node {self.node}: {error}")
+
+        crc = zlib.crc32(image)
+        # 消去は1ページ20ms程度かかる
+        reply = self.request(bytes([START]) + len(image).to_bytes(3, "big") + crc.to_bytes(4, "big"), timeout=2.0)
+        if reply[0] != ACK or reply[2] != target:
+            raise FlashError(f"node {self.node}: start failed")
+        self.log(f"node {self.node}: writing {len(image)} bytes to slot {target}")
+
+        self.send_data(image, window)
+
+        reply = self.request(bytes([FINISH]), timeout=1.0)
+        if reply[0] != ACK:
+            raise FlashError(f"node {self.node}: crc mismatch")
+        # 返事の後すぐリセットするので、送り直しても答えないことがある
+        try:
+            self.request(bytes([BOOT]))
+        except FlashError:
+            self.log(f"node {self.node}: no reply to boot, assuming it has reset")
+        self.log(f"node {self.node}: done, booting slot {target}")
+
+    def send_data(self, image, window):
+        acked = 0
+        last_nack = None
+        failures = 0
+        while acked < len(image):
+            self.drain()
+            offset = acked
+            for _ in range(window):
+                if offset >= len(image):
+                    break
+                sequence = (offset // DATA_PER_FRAME) & 0xFF
+                self.send(bytes([DATA, sequence]) + image[offset:offset + DATA_PER_FRAME])
+                offset += DATA_PER_FRAME
+
+            progressed = False
+            deadline = time.monotonic() + self.timeout
+            while (remaining := deadline - time.monotonic()) > 0:
+                reply = self.receive(remaining)
+                if reply is None or len(reply) < 6 or reply[1] != DATA:
+                    continue
+                if reply[0] == ERROR:
+                    raise FlashError(f"node {self.node}: program failed")
+                position = int.from_bytes(reply[2:6], "big")
+                if reply[0] == ACK and position > acked:
+                    acked = position
+                    progressed = True
+                    if acked >= offset or acked == len(image):
+                        break
+                elif reply[0] == NACK:
+                    # 飛んだ後のフレームごとに同じNackが来るので、最初の1つだけで送り直す
+                    if position == last_nack:
+                        continue
+                    last_nack = position
+                    acked = position
+                    progressed = True
+                    break
+
+            # 返事が無ければ最後にAckされたところから送り直す
+            failures = 0 if progressed else failures + 1
+            if failures >= self.retries:
+                raise FlashError(f"node {self.node}: no progress at offset {acked}")
+
+
+def enter_bootloader(bus, nodes):
+    """アプリケーションで動いているボードをブートローダに入れる。0x147はバス上の全ボードが受ける"""
+    bus.send(APP_BOOTLOADER_ID, b"BOOT")
+    time.sleep(0.5)
+
+
+def flash_all(bus, nodes, images, timeout, verbose):
+    log = print if verbose else None
+    errors = {}
+
+    def run(node):
+        try:
+            Flasher(bus, node, timeout=timeout, log=log).flash(images)
+        except FlashError as error:
+            errors[node] = error
+
+    threads = [threading.Thread(target=run, args=(node,)) for node in nodes]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return errors
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("images", nargs="*", help="slot A and slot B images (.bin)")
+    parser.add_argument("--nodes", type=lambda s: int(s, 0), nargs="+", default=[0], help="node ids (option byte Data0)")
+    parser.add_argument("--interface", default="socketcan")
+    parser.add_argument("--channel", default="can0")
+    parser.add_argument("--bitrate", type=int, default=750_000)
+    parser.add_argument("--enter", action="store_true", help="send \"BOOT\" to 0x147 first")
+    parser.add_argument("--timeout", type=float, default=0.2)
+    parser.add_argument("--check", action="store_true", help="only check that the images are linked for their slots")
+    parser.add_argument("--simulate", action="store_true", help="flash simulated nodes instead of a real bus")
+    parser.add_argument("--loss", type=float, default=0.0, help="frame loss ratio for --simulate")
+    parser.add_argument("--size", type=int, default=16 * 1024, help="random image size for --simulate without images")
+    parser.add_argument("--seed", type=int)
+    parser.add_argument("-q", "--quiet", action="store_true")
+    args = parser.parse_args()
+
+    if args.images and len(args.images) != 2:
+        parser.error("give both slot A and slot B images")
+    if args.images:
+        images = []
+        for path in args.images:
+            with open(path, "rb") as file:
+                images.append(file.read())
+    elif args.simulate and not args.check:
+        images = [make_test_image(slot, args.size) for slot in range(2)]
+    else:
+        parser.error("images are required")
+
+    if args.check:
+        errors = [error for slot, image in enumerate(images) if (error := check_image(image, slot)) is not None]
+        for error in errors:
+            print(error, file=sys.stderr)
+        return 1 if errors else 0
+
+    if args.simulate:
+        bus = SimulatedBus(args.nodes, loss=args.loss, seed=args.seed)
+        timeout = min(args.timeout, 0.05)
+    else:
+        bus = PythonCanBus(args.interface, args.channel, args.bitrate)
+        timeout = args.timeout
+
+    try:
+        if args.enter:
+            enter_bootloader(bus, args.nodes)
+        start = time.monotonic()
+        errors = flash_all(bus, args.nodes, images, timeout, not args.quiet)
+        elapsed = time.monotonic() - start
+    finally:
+        bus.close()
+
+    if args.simulate:
+        for node in args.nodes:
+            simulated = bus.nodes[node]
+            slot = simulated.newest()
+            if node not in errors and (slot is None or bytes(simulated.slots[slot][:len(images[slot])]) != images[slot]):
+                errors[node] = FlashError(f"node {node}: simulated flash does not match the image")
+
+    for error in errors.values():
+        print(error, file=sys.stderr)
+    print(f"{len(args.nodes) - len(errors)}/{len(args.nodes)} nodes flashed in {elapsed:.2f} s")
+    return 1 if errors else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())